@@ -192,8 +192,10 @@ bin_strftime(char *nam, char **argv, Options ops, int func)
     startparamscope();
     if (tz && *tz) {
 	Param pm = createparam("TZ", PM_LOCAL|PM_SCALAR|PM_EXPORTED);
-	if (pm)
+	if (pm) {
 	    pm->level = locallevel; /* because createparam() doesn't */
+	    scopeparam(pm);
+	}
 	setsparam("TZ", ztrdup(tz));
     }
     result = output_strftime(nam, argv, ops, func);
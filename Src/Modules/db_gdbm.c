@@ -664,8 +664,10 @@ static Param createhash( char *name, int flags ) {
         return NULL;
     }
 
-    if (pm->old)
+    if (pm->old) {
 	pm->level = locallevel;
+	scopeparam(pm);
+    }
 
     /* This creates standard hash. */
     ht = pm->u.hash = newparamtable(17, name);
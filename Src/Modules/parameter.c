@@ -1182,6 +1182,13 @@ getpmhistory(UNUSED(HashTable ht), const char *name)
     return &pm->node;
 }
 
+/*
+ * Lines that can't match a subscript pattern are passed over here
+ * without copying them, and the scan stops as soon as it has what
+ * it needs, so e.g. ${history[(r)pat]} only looks back as far as
+ * the most recent match.
+ */
+
 /**/
 static void
 scanpmhistory(UNUSED(HashTable ht), ScanFunc func, int flags)
@@ -1189,55 +1196,123 @@ scanpmhistory(UNUSED(HashTable ht), ScanFunc func, int flags)
     struct param pm;
     int i = addhistnum(curhist, -1, HIST_FOREIGN);
     Histent he = gethistent(i, GETHIST_UPWARD);
+    Patprog prog = scanparampattern(func, flags);
     char buf[40];
 
     memset((void *)&pm, 0, sizeof(struct param));
     pm.node.flags = PM_SCALAR | PM_READONLY;
     pm.gsu.s = &nullsetscalar_gsu;
 
-    while (he) {
+    for (; he; he = up_histent(he)) {
 	if (func != scancountparams) {
 	    convbase(buf, he->histnum, 10);
+	    if (prog && !pattry(prog, (flags & SCANPM_MATCHKEY) ?
+				buf : he->node.nam))
+		continue;
 	    pm.node.nam = dupstring(buf);
 	    if ((flags & (SCANPM_WANTVALS|SCANPM_MATCHVAL)) ||
 		!(flags & SCANPM_WANTKEYS))
 		pm.u.str = dupstring(he->node.nam);
 	}
 	func(&pm.node, flags);
-
-	he = up_histent(he);
+	if (scanparamsdone(func, flags))
+	    break;
     }
 }
 
 /* Function for the historywords special parameter. */
 
+/*
+ * The words are counted first so the array can be filled in
+ * directly, rather than going through a list of them all.
+ */
+
 /**/
 static char **
 histwgetfn(UNUSED(Param pm))
 {
-    char *h, *e, sav;
-    LinkList l = newlinklist(), ll;
+    char **arr, **p;
+    LinkList ll;
     LinkNode n;
-    int i = addhistnum(curhist, -1, HIST_FOREIGN), iw;
-    Histent he = gethistent(i, GETHIST_UPWARD);
+    int i = addhistnum(curhist, -1, HIST_FOREIGN), iw, nw = 0;
+    Histent first = gethistent(i, GETHIST_UPWARD), he;
 
     if ((ll = bufferwords(NULL, NULL, NULL, 0)))
-        for (n = firstnode(ll); n; incnode(n))
-            pushnode(l, getdata(n));
-
-    while (he) {
-	for (iw = he->nwords - 1; iw >= 0; iw--) {
-	    h = he->node.nam + he->words[iw * 2];
-	    e = he->node.nam + he->words[iw * 2 + 1];
-	    sav = *e;
-	    *e = '\0';
-	    addlinknode(l, dupstring(h));
-	    *e = sav;
-	}
-	he = up_histent(he);
+	nw = countlinknodes(ll);
+    for (he = first; he; he = up_histent(he)) {
+	gethistwords(he);
+	nw += he->nwords;
+    }
+    p = arr = (char **) zhalloc((nw + 1) * sizeof(char *));
+
+    if (ll)
+	for (n = lastnode(ll); n != &ll->node; decnode(n))
+	    *p++ = (char *) getdata(n);
+    for (he = first; he; he = up_histent(he))
+	for (iw = he->nwords - 1; iw >= 0; iw--)
+	    *p++ = dupstrpfx(he->node.nam + he->words[iw * 2],
+			     he->words[iw * 2 + 1] - he->words[iw * 2]);
+    *p = NULL;
+
+    return arr;
+}
+
+/* Functions for the historystats special parameter. */
+
+static const char *histstatnames[] = { "lines", "chunks", "size", "used" };
+
+/**/
+static HashNode
+getpmhiststat(UNUSED(HashTable ht), const char *name)
+{
+    Param pm = NULL;
+    zlong stats[4];
+    char buf[40];
+    int i;
+
+    pm = (Param) hcalloc(sizeof(struct param));
+    pm->node.nam = dupstring(name);
+    pm->node.flags = PM_SCALAR | PM_READONLY;
+    pm->gsu.s = &nullsetscalar_gsu;
+
+    histarenastats(stats, stats + 1, stats + 2, stats + 3);
+    for (i = 0; i < 4; i++)
+	if (!strcmp(name, histstatnames[i]))
+	    break;
+    if (i < 4) {
+	convbase(buf, stats[i], 10);
+	pm->u.str = dupstring(buf);
+    } else {
+	pm->u.str = dupstring("");
+	pm->node.flags |= (PM_UNSET|PM_SPECIAL);
     }
+    return &pm->node;
+}
+
+/**/
+static void
+scanpmhiststats(UNUSED(HashTable ht), ScanFunc func, int flags)
+{
+    struct param pm;
+    zlong stats[4];
+    char buf[40];
+    int i;
 
-    return hlinklist2array(l, 0);
+    memset((void *)&pm, 0, sizeof(struct param));
+    pm.node.flags = PM_SCALAR | PM_READONLY;
+    pm.gsu.s = &nullsetscalar_gsu;
+
+    histarenastats(stats, stats + 1, stats + 2, stats + 3);
+    for (i = 0; i < 4; i++) {
+	pm.node.nam = (char *)histstatnames[i];
+	if (func != scancountparams &&
+	    ((flags & (SCANPM_WANTVALS|SCANPM_MATCHVAL)) ||
+	     !(flags & SCANPM_WANTKEYS))) {
+	    convbase(buf, stats[i], 10);
+	    pm.u.str = dupstring(buf);
+	}
+	func(&pm.node, flags);
+    }
 }
 
 /* Functions for the jobtexts special parameter. */
@@ -2232,6 +2307,8 @@ static struct paramdef partab[] = {
 	    &pmgaliases_gsu, getpmgalias, scanpmgaliases),
     SPECIALPMDEF("history", PM_READONLY_SPECIAL,
 	    NULL, getpmhistory, scanpmhistory),
+    SPECIALPMDEF("historystats", PM_READONLY_SPECIAL,
+	    NULL, getpmhiststat, scanpmhiststats),
     SPECIALPMDEF("historywords", PM_ARRAY|PM_READONLY_SPECIAL,
 	    &historywords_gsu, NULL, NULL),
     SPECIALPMDEF("jobdirs", PM_READONLY_SPECIAL,
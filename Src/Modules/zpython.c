@@ -2,6 +2,18 @@
 #include "zpython.pro"
 #include <Python.h>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#ifdef HAVE_DLFCN_H
+# include <dlfcn.h>
+#endif
+
+#if PY_VERSION_HEX >= 0x03050000
+/* The zsh module uses multi-phase initialization and per-module state */
+# define ZPYTHON_MULTIPHASE
+#endif
+
 #if PY_MAJOR_VERSION >= 3
 # define PyString_Check             PyBytes_Check
 # define PyString_FromString        PyBytes_FromString
@@ -32,20 +44,79 @@ struct obj_hash_node {
     struct specialparam *sp;
 };
 
-static PyObject *globals;
 static zlong zpython_subshell;
-static PyObject *hashdict = NULL;
 static struct specialparam *first_assigned_param = NULL;
 static struct specialparam *last_assigned_param = NULL;
 static PyGILState_STATE pygilstate = PyGILState_UNLOCKED;
 
+#define FLUSH_ALWAYS   0
+#define FLUSH_DEFERRED 1
+
+static int flush_mode = FLUSH_ALWAYS;
+/* This is the shared worker: the zsh module must not be available */
+static int zpython_worker = 0;
+/* Something was written to stdout/stderr since they were last flushed */
+static int output_pending = 0;
+
+/*
+ * State of the zsh python module.  With multi-phase initialization it lives
+ * in the module object, so it goes away with the interpreter; older pythons
+ * have no per-module state and keep it in a static instead.
+ */
+
+struct zsh_module_state {
+#ifdef ZPYTHON_MULTIPHASE
+    PyObject *environ_generator_type;
+    PyObject *environ_type;
+#endif
+    PyObject *globals;		/* dictionary of __main__ */
+    PyObject *hashdict;		/* dictionary get_hash() fills, not owned */
+};
+
+#ifdef ZPYTHON_MULTIPHASE
+# define ZSH_MODULE_STATE(module) \
+    ((struct zsh_module_state *) PyModule_GetState(module))
+#else
+static struct zsh_module_state zsh_static_state;
+# define ZSH_MODULE_STATE(module) (&zsh_static_state)
+#endif
+
+/*
+ * Return the state of the zsh module, importing it if need be, or NULL
+ * with a python exception set.  *modp is set to a reference to the module
+ * that keeps the state alive; release it with Py_XDECREF.
+ */
+
+static struct zsh_module_state *
+get_module_state(PyObject **modp)
+{
+#ifdef ZPYTHON_MULTIPHASE
+    struct zsh_module_state *st;
+
+    if (!(*modp = PyImport_ImportModule("zsh")))
+	return NULL;
+    if (!(st = ZSH_MODULE_STATE(*modp)))
+	Py_CLEAR(*modp);
+    return st;
+#else
+    *modp = NULL;
+    return &zsh_static_state;
+#endif
+}
 
 static void
 after_fork()
 {
+    PyObject *module;
+    struct zsh_module_state *st;
+
     zpython_subshell = zsh_subshell;
-    hashdict = NULL;
     PyOS_AfterFork_Child();
+    if ((st = get_module_state(&module)))
+	st->hashdict = NULL;
+    else
+	PyErr_Clear();
+    Py_XDECREF(module);
 }
 
 #define PYTHON_INIT(failval) \
@@ -90,22 +161,146 @@ flush_io()
     fflush(stderr);
     fflush(stdout);
 #endif
+    output_pending = 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+/* Stands in for the write method of a stream, self is the original */
+
+static PyObject *
+TrackedWrite(PyObject *write, PyObject *args)
+{
+    output_pending = 1;
+    return PyObject_CallObject(write, args);
+}
+
+static PyMethodDef TrackedWriteDef =
+{"write", TrackedWrite, METH_VARARGS, NULL};
+#endif
+
+/*
+ * In deferred mode writes to python's own sys.stdout and sys.stderr mark
+ * output as pending: their write method is shadowed with TrackedWrite
+ * while the mode is on.  Streams the user provided are left alone, and
+ * whenever one of those is in place output is assumed to be pending.
+ */
+
+static const char *const std_streams[2][2] = {
+    { "stdout", "__stdout__" },
+    { "stderr", "__stderr__" }
+};
+static PyObject *tracked_streams[2];
+
+static void
+track_output(void)
+{
+#if PY_MAJOR_VERSION >= 3
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	PyObject *stream = PySys_GetObject(std_streams[i][0]);
+	PyObject *write, *tracked;
+
+	if (!stream || stream != PySys_GetObject(std_streams[i][1]) ||
+	    !(write = PyObject_GetAttrString(stream, "write"))) {
+	    PyErr_Clear();
+	    continue;
+	}
+	if ((tracked = PyCFunction_New(&TrackedWriteDef, write)) &&
+	    !PyObject_SetAttrString(stream, "write", tracked)) {
+	    tracked_streams[i] = stream;
+	    Py_INCREF(stream);
+	}
+	Py_XDECREF(tracked);
+	Py_DECREF(write);
+	PyErr_Clear();
+    }
+#endif
+}
+
+static void
+untrack_output(void)
+{
+#if PY_MAJOR_VERSION >= 3
+    int i;
+
+    for (i = 0; i < 2; i++)
+	if (tracked_streams[i]) {
+	    PyObject *write = PyObject_GetAttrString(tracked_streams[i],
+						     "write");
+
+	    /* Unless somebody has replaced it in the meantime */
+	    if (write && PyCFunction_Check(write) &&
+		PyCFunction_GET_FUNCTION(write) == (PyCFunction) TrackedWrite)
+		PyObject_DelAttrString(tracked_streams[i], "write");
+	    Py_XDECREF(write);
+	    PyErr_Clear();
+	    Py_CLEAR(tracked_streams[i]);
+	}
+#endif
+}
+
+static void
+finish_io()
+{
+    if (flush_mode == FLUSH_DEFERRED) {
+	if (PySys_GetObject("stdout") != tracked_streams[0] ||
+	    PySys_GetObject("stderr") != tracked_streams[1])
+	    output_pending = 1;
+    } else
+	flush_io();
 }
 
 #define PYTHON_FINISH \
-    flush_io(); \
+    finish_io(); \
     PYTHON_SAVE_THREAD
 
+/*
+ * In deferred mode output is flushed when control returns to the command
+ * loop, before forking and before exec'ing an external command.
+ */
+
+static int
+flushhook(UNUSED(Hookdef d), UNUSED(void *dummy))
+{
+    PyGILState_STATE gilstate;
+
+    if (!output_pending)
+	return 0;
+
+    gilstate = PyGILState_Ensure();
+    flush_io();
+    PyGILState_Release(gilstate);
+    return 0;
+}
+
+static int init_python(void);
+static int run_remote(char *nam, char *code);
+
 /**/
 static int
 do_zpython(char *nam, char **args, Options ops, int func)
 {
-    PyObject *result;
+    PyObject *result, *module;
+    struct zsh_module_state *st;
     int exit_code = 0;
 
+    if (OPT_ISSET(ops,'r'))
+	return run_remote(nam, *args);
+
+    if (!Py_IsInitialized() && init_python()) {
+	zwarnnam(nam, "failed to initialize python");
+	return 2;
+    }
+
     PYTHON_INIT(2);
 
-    result = PyRun_String(*args, Py_file_input, globals, globals);
+    if (!(st = get_module_state(&module)))
+	result = NULL;
+    else
+	result = PyRun_String(*args, Py_file_input,
+			      st->globals, st->globals);
+    Py_XDECREF(module);
     if (result == NULL)
     {
 	if (PyErr_Occurred()) {
@@ -208,19 +403,22 @@ get_string(const char *s)
     return r;
 }
 
+/* Module state of the get_hash() in progress */
+static struct zsh_module_state *scanstate;
+
 static void
 scanhashdict(HashNode hn, UNUSED(int flags))
 {
     struct value v;
     PyObject *key, *val;
 
-    if (hashdict == NULL)
+    if (scanstate->hashdict == NULL)
 	return;
 
     v.pm = (Param) hn;
 
     if (!(key = get_string(v.pm->node.nam))) {
-	hashdict = NULL;
+	scanstate->hashdict = NULL;
 	return;
     }
 
@@ -229,13 +427,13 @@ scanhashdict(HashNode hn, UNUSED(int flags))
     v.start = 0;
     v.end = -1;
     if (!(val = get_string(getstrvalue(&v)))) {
-	hashdict = NULL;
+	scanstate->hashdict = NULL;
 	Py_DECREF(key);
 	return;
     }
 
-    if (PyDict_SetItem(hashdict, key, val) == -1)
-	hashdict = NULL;
+    if (PyDict_SetItem(scanstate->hashdict, key, val) == -1)
+	scanstate->hashdict = NULL;
 
     Py_DECREF(key);
     Py_DECREF(val);
@@ -261,32 +459,33 @@ get_array(char **ss)
 }
 
 static PyObject *
-get_hash(HashTable ht)
+get_hash(struct zsh_module_state *st, HashTable ht)
 {
     PyObject *hd;
 
-    if (hashdict) {
+    if (st->hashdict) {
 	PyErr_SetString(PyExc_RuntimeError, "hashdict already used. "
 		"Do not try to get two hashes simultaneously in "
 		"separate threads, zsh is not thread-safe");
 	return NULL;
     }
 
-    hashdict = PyDict_New();
-    hd = hashdict;
+    if (!(hd = st->hashdict = PyDict_New()))
+	return NULL;
 
+    scanstate = st;
     scanhashtable(ht, 0, 0, 0, scanhashdict, 0);
-    if (hashdict == NULL) {
+    if (st->hashdict == NULL) {
 	Py_DECREF(hd);
 	return NULL;
     }
 
-    hashdict = NULL;
+    st->hashdict = NULL;
     return hd;
 }
 
 static PyObject *
-ZshGetValue(UNUSED(PyObject *self), PyObject *args)
+ZshGetValue(PyObject *self, PyObject *args)
 {
     char *name;
     struct value vbuf;
@@ -307,7 +506,7 @@ ZshGetValue(UNUSED(PyObject *self), PyObject *args)
 
     switch (PM_TYPE(v->pm->node.flags)) {
     case PM_HASHED:
-	return get_hash(v->pm->gsu.h->getfn(v->pm));
+	return get_hash(ZSH_MODULE_STATE(self), v->pm->gsu.h->getfn(v->pm));
     case PM_ARRAY:
 	v->arr = v->pm->gsu.a->getfn(v->pm);
 	if (v->isarr) {
@@ -506,6 +705,312 @@ ZshSetValue(UNUSED(PyObject *self), PyObject *args)
     Py_RETURN_NONE;
 }
 
+static PyObject *
+ZshExpand(UNUSED(PyObject *self), PyObject *args)
+{
+    PyObject *wordobj, *r;
+    char *flags = "", *word;
+    int pf_flags = 0, doglob = 0;
+    LinkList list;
+    LinkNode node;
+    size_t i = 0;
+
+    if (!PyArg_ParseTuple(args, "O|s", &wordobj, &flags))
+	return NULL;
+
+    if (!IS_PY_STRING(wordobj)) {
+	PyErr_SetString(PyExc_TypeError, "Word must be a string");
+	return NULL;
+    }
+
+    for (; *flags; flags++) {
+	switch (*flags) {
+	case 's':
+	    pf_flags |= PREFORK_SINGLE;
+	    break;
+	case 'w':
+	    pf_flags |= PREFORK_SPLIT;
+	    break;
+	case 'g':
+	    doglob = 1;
+	    break;
+	default:
+	    PyErr_Format(PyExc_ValueError, "Unknown expansion flag: %c", *flags);
+	    return NULL;
+	}
+    }
+
+    pushheap();
+
+    if (!(word = (char *)get_chars(wordobj, zhalloc))) {
+	popheap();
+	return NULL;
+    }
+
+    if (parse_subst_string(word)) {
+	popheap();
+	PyErr_SetString(PyExc_ValueError, "Failed to parse word");
+	return NULL;
+    }
+
+    list = newlinklist();
+    addlinknode(list, word);
+    prefork(list, pf_flags, NULL);
+    if (!errflag && doglob)
+	globlist(list, 0);
+    if (errflag) {
+	errflag &= ~ERRFLAG_ERROR;
+	popheap();
+	PyErr_SetString(PyExc_RuntimeError, "Expansion failed");
+	return NULL;
+    }
+
+    if (pf_flags & PREFORK_SINGLE) {
+	/* Same as singsub(): join whatever was produced into one word */
+	word = sepjoin((char **)hlinklist2array(list, 0), NULL, 1);
+	list = newlinklist();
+	addlinknode(list, word);
+    }
+
+    if (!(r = PyList_New(countlinknodes(list)))) {
+	popheap();
+	return NULL;
+    }
+    for (node = firstnode(list); node; incnode(node)) {
+	PyObject *str;
+	char *s = (char *) getdata(node);
+
+	untokenize(s);
+	if (!(str = get_string(s))) {
+	    Py_DECREF(r);
+	    popheap();
+	    return NULL;
+	}
+	PyList_SET_ITEM(r, i++, str);
+    }
+
+    popheap();
+    return r;
+}
+
+static PyObject *
+ZshSetFlushMode(UNUSED(PyObject *self), PyObject *args)
+{
+    char *mode;
+    int prev = flush_mode;
+
+    if (!PyArg_ParseTuple(args, "s", &mode))
+	return NULL;
+
+    if (!strcmp(mode, "always")) {
+	flush_mode = FLUSH_ALWAYS;
+	untrack_output();
+    } else if (!strcmp(mode, "deferred")) {
+	if (prev != FLUSH_DEFERRED) {
+	    /* Whatever was written so far hasn't been noticed */
+	    output_pending = 1;
+	    track_output();
+	}
+	flush_mode = FLUSH_DEFERRED;
+    } else {
+	PyErr_SetString(PyExc_ValueError,
+		"Flush mode must be either \"always\" or \"deferred\"");
+	return NULL;
+    }
+
+    return Py_BuildValue("s", prev == FLUSH_DEFERRED ? "deferred" : "always");
+}
+
+/*
+ * Idle-time garbage collection.
+ *
+ * With zsh.set_gc_mode("idle") automatic collection is disabled and the
+ * generations that are due are collected one at a time while ZLE waits for
+ * a key, until the budget for that idle slice is used up or input arrives.
+ * Without ZLE nothing is ever collected in this mode.
+ */
+
+#define GC_AUTO 0
+#define GC_IDLE 1
+
+static int gc_mode = GC_AUTO;
+static double gc_budget = 0.005;
+
+static struct {
+    long slices;
+    long collections[3];
+    double total_pause[3];
+    double max_pause[3];
+} gcstats;
+
+static double
+elapsed(struct timespec *from)
+{
+    struct timespec now;
+
+    zgettime_monotonic_if_available(&now);
+    return (double) (now.tv_sec - from->tv_sec) +
+	(double) (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int
+input_pending(void)
+{
+    struct pollfd pfd;
+
+    if (SHTTY == -1)
+	return 0;
+    pfd.fd = SHTTY;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Call a function of the gc module, returning a new reference */
+
+static PyObject *
+gc_call(const char *func, const char *format, ...)
+{
+    PyObject *gc, *fn, *args, *r = NULL;
+    va_list ap;
+
+    if (!(gc = PyImport_ImportModule("gc")))
+	return NULL;
+    if ((fn = PyObject_GetAttrString(gc, func))) {
+	va_start(ap, format);
+	args = Py_VaBuildValue(format, ap);
+	va_end(ap);
+	if (args) {
+	    r = PyObject_CallObject(fn, args);
+	    Py_DECREF(args);
+	}
+	Py_DECREF(fn);
+    }
+    Py_DECREF(gc);
+    return r;
+}
+
+/* Oldest generation whose collection is due, -1 if none */
+
+static int
+gc_due_generation(void)
+{
+    PyObject *count, *threshold;
+    int gen = -1, i;
+
+    if (!(count = gc_call("get_count", "()")))
+	return -1;
+    if (!(threshold = gc_call("get_threshold", "()"))) {
+	Py_DECREF(count);
+	return -1;
+    }
+    for (i = 0; i < 3; i++) {
+	long c = PyLong_AsLong(PyTuple_GetItem(count, i));
+	long t = PyLong_AsLong(PyTuple_GetItem(threshold, i));
+
+	if (t > 0 && c > t)
+	    gen = i;
+	else if (!t && !i)
+	    break;
+    }
+    Py_DECREF(count);
+    Py_DECREF(threshold);
+    PyErr_Clear();
+    return gen;
+}
+
+static int
+gcidlehook(UNUSED(Hookdef d), UNUSED(void *dummy))
+{
+    PyGILState_STATE gilstate;
+    struct timespec start, t0;
+    int gen;
+
+    if (gc_mode != GC_IDLE || !Py_IsInitialized() || input_pending())
+	return 0;
+
+    gilstate = PyGILState_Ensure();
+    zgettime_monotonic_if_available(&start);
+    gcstats.slices++;
+    while ((gen = gc_due_generation()) >= 0) {
+	PyObject *r;
+	double pause;
+
+	zgettime_monotonic_if_available(&t0);
+	if ((r = gc_call("collect", "(i)", gen)))
+	    Py_DECREF(r);
+	else
+	    PyErr_Clear();
+	pause = elapsed(&t0);
+	gcstats.collections[gen]++;
+	gcstats.total_pause[gen] += pause;
+	if (pause > gcstats.max_pause[gen])
+	    gcstats.max_pause[gen] = pause;
+	if (elapsed(&start) >= gc_budget || input_pending())
+	    break;
+    }
+    PyGILState_Release(gilstate);
+    return 0;
+}
+
+static int
+set_gc_mode(int mode)
+{
+    PyObject *r;
+
+    if (!(r = gc_call(mode == GC_IDLE ? "disable" : "enable", "()")))
+	return 1;
+    Py_DECREF(r);
+    gc_mode = mode;
+    return 0;
+}
+
+static PyObject *
+ZshSetGCMode(UNUSED(PyObject *self), PyObject *args)
+{
+    char *mode;
+    int prev = gc_mode;
+    double budget = gc_budget;
+
+    if (!PyArg_ParseTuple(args, "s|d", &mode, &budget))
+	return NULL;
+
+    if (budget <= 0) {
+	PyErr_SetString(PyExc_ValueError, "Budget must be positive");
+	return NULL;
+    }
+    if (!strcmp(mode, "auto")) {
+	if (set_gc_mode(GC_AUTO))
+	    return NULL;
+    }
+    else if (!strcmp(mode, "idle")) {
+	if (set_gc_mode(GC_IDLE))
+	    return NULL;
+	gc_budget = budget;
+    }
+    else {
+	PyErr_SetString(PyExc_ValueError,
+		"GC mode must be either \"auto\" or \"idle\"");
+	return NULL;
+    }
+
+    return Py_BuildValue("s", prev == GC_IDLE ? "idle" : "auto");
+}
+
+static PyObject *
+ZshGCStats(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    return Py_BuildValue("{s:s,s:d,s:l,s:(lll),s:(ddd),s:(ddd)}",
+	    "mode", gc_mode == GC_IDLE ? "idle" : "auto",
+	    "budget", gc_budget,
+	    "idle_slices", gcstats.slices,
+	    "collections", gcstats.collections[0], gcstats.collections[1],
+		gcstats.collections[2],
+	    "total_pause", gcstats.total_pause[0], gcstats.total_pause[1],
+		gcstats.total_pause[2],
+	    "max_pause", gcstats.max_pause[0], gcstats.max_pause[1],
+		gcstats.max_pause[2]);
+}
+
 static PyObject *
 ZshExitCode(UNUSED(PyObject *self), UNUSED(PyObject *args))
 {
@@ -1264,6 +1769,29 @@ ZshSetMagicHash(UNUSED(PyObject *self), PyObject *args)
 static struct PyMethodDef ZshMethods[] = {
     {"eval", ZshEval, METH_O,
 	"Evaluate command in current shell context",},
+    {"set_flush_mode", ZshSetFlushMode, METH_VARARGS,
+	"Set when python stdout and stderr are flushed. Returns previous mode.\n"
+	"  \"always\"   flush after each zpython call and special parameter access\n"
+	"  \"deferred\" flush only when control returns to the command loop or\n"
+	"             before zsh forks or runs an external command"},
+    {"expand", ZshExpand, METH_VARARGS,
+	"Perform shell expansions on a word, as if it were a command argument.\n"
+	"Returns a list of str. Second argument is a string of flags:\n"
+	"  s  do not split result into several words\n"
+	"  w  split result of unquoted expansions on IFS\n"
+	"  g  perform filename generation on the result\n"
+	"Throws ValueError   if word cannot be parsed or flag is unknown,\n"
+	"       RuntimeError if expansion failed"},
+    {"set_gc_mode", ZshSetGCMode, METH_VARARGS,
+	"Set how python cyclic garbage collection is scheduled. Returns previous mode.\n"
+	"  \"auto\"         python collects whenever its thresholds are crossed\n"
+	"  \"idle\"[, budget] automatic collection is disabled, due generations are\n"
+	"                 collected while zle waits for input, for at most budget\n"
+	"                 seconds (default 0.005) per idle slice"},
+    {"gc_stats", ZshGCStats, METH_NOARGS,
+	"Get idle-time garbage collection statistics. Returns a dict with\n"
+	"  mode, budget, idle_slices and per-generation tuples\n"
+	"  collections, total_pause and max_pause (in seconds)"},
     {"last_exit_code", ZshExitCode, METH_NOARGS,
 	"Get last exit code. Returns an int"},
     {"pipestatus", ZshPipeStatus, METH_NOARGS,
@@ -1348,8 +1876,6 @@ static struct PyMethodDef ZshMethods[] = {
     {NULL, NULL, 0, NULL},
 };
 
-static PyTypeObject EnvironGeneratorType;
-
 typedef PyObject *(*SingleEnvItemGenerator) (char *);
 
 typedef struct {
@@ -1358,6 +1884,11 @@ typedef struct {
     SingleEnvItemGenerator getobject;
 } EnvironGeneratorObject;
 
+typedef struct {
+    PyObject_HEAD
+    PyTypeObject *gentype;
+} EnvironObject;
+
 static PyObject *
 EnvironGeneratorNext(PyObject *self)
 {
@@ -1377,9 +1908,12 @@ EnvironGeneratorIter(PyObject *self)
 }
 
 static PyObject *
-EnvironGeneratorNew(SingleEnvItemGenerator getobject)
+EnvironGeneratorNew(PyObject *env, SingleEnvItemGenerator getobject)
 {
-    EnvironGeneratorObject *self = PyObject_NEW(EnvironGeneratorObject, &EnvironGeneratorType);
+    EnvironGeneratorObject *self =
+	PyObject_NEW(EnvironGeneratorObject, ((EnvironObject *) env)->gentype);
+    if (!self)
+	return NULL;
     self->environ = environ;
     self->getobject = getobject;
     return (PyObject *) self;
@@ -1424,24 +1958,22 @@ EnvironGetItem(char *eitem)
 	    eitem, (int) (p - eitem), p + 1);
 }
 
-static PyTypeObject EnvironType;
-
 static PyObject *
-EnvironKeys(UNUSED(PyObject *self))
+EnvironKeys(PyObject *self)
 {
-    return EnvironGeneratorNew(EnvironGetKey);
+    return EnvironGeneratorNew(self, EnvironGetKey);
 }
 
 static PyObject *
-EnvironValues(UNUSED(PyObject *self))
+EnvironValues(PyObject *self)
 {
-    return EnvironGeneratorNew(EnvironGetValue);
+    return EnvironGeneratorNew(self, EnvironGetValue);
 }
 
 static PyObject *
-EnvironItems(UNUSED(PyObject *self))
+EnvironItems(PyObject *self)
 {
-    return EnvironGeneratorNew(EnvironGetItem);
+    return EnvironGeneratorNew(self, EnvironGetItem);
 }
 
 static PyObject *
@@ -1614,7 +2146,7 @@ EnvironItem(UNUSED(PyObject *self), PyObject *keyObject)
     return PyString_FromString(val);
 }
 
-static PyObject *
+static int
 EnvironAssItem(PyObject *self, PyObject *keyObject, PyObject *valObject)
 {
     if (valObject == NULL) {
@@ -1622,26 +2154,26 @@ EnvironAssItem(PyObject *self, PyObject *keyObject, PyObject *valObject)
 	PyObject *item;
 
 	if (!(args = PyTuple_Pack(1, keyObject)))
-	    return NULL;
+	    return -1;
 	if (!(item = EnvironPop(self, args))) {
 	    Py_DECREF(args);
-	    return NULL;
+	    return -1;
 	}
 	Py_DECREF(args);
 	Py_DECREF(item);
-	Py_RETURN_NONE;
+	return 0;
     }
     else {
 	char *var;
 	char *val;
 	if (!(var = get_no_null_chars(keyObject)))
-	    return NULL;
+	    return -1;
 
 	if (!(val = get_no_null_chars(valObject)))
-	    return NULL;
+	    return -1;
 
 	assignsparam(var, val, PM_EXPORTED);
-	Py_RETURN_NONE;
+	return 0;
     }
 }
 
@@ -1657,16 +2189,140 @@ EnvironLength(UNUSED(PyObject *self))
     return r;
 }
 
+#ifdef ZPYTHON_MULTIPHASE
+static void
+EnvironGeneratorDealloc(PyObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    type->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    Py_DECREF(type);
+#endif
+}
+
+static void
+EnvironDealloc(PyObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_XDECREF(((EnvironObject *) self)->gentype);
+    type->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    Py_DECREF(type);
+#endif
+}
+
+static PyType_Slot EnvironGeneratorSlots[] = {
+    {Py_tp_dealloc, EnvironGeneratorDealloc},
+    {Py_tp_iter, EnvironGeneratorIter},
+    {Py_tp_iternext, EnvironGeneratorNext},
+    {0, NULL},
+};
+
+static PyType_Spec EnvironGeneratorSpec = {
+    "zsh.environ_generator",
+    sizeof(EnvironGeneratorObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    EnvironGeneratorSlots,
+};
+
+static PyType_Slot EnvironSlots[] = {
+    {Py_tp_dealloc, EnvironDealloc},
+    {Py_tp_methods, EnvironMethods},
+    {Py_mp_length, EnvironLength},
+    {Py_mp_subscript, EnvironItem},
+    {Py_mp_ass_subscript, EnvironAssItem},
+    {0, NULL},
+};
+
+static PyType_Spec EnvironSpec = {
+    "zsh.environ",
+    sizeof(EnvironObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    EnvironSlots,
+};
+
+static int
+zsh_module_exec(PyObject *module)
+{
+    struct zsh_module_state *st = ZSH_MODULE_STATE(module);
+    EnvironObject *env;
+    PyObject *main_module;
+
+    if (!(main_module = PyImport_AddModule("__main__")) ||
+	!(st->globals = PyModule_GetDict(main_module)))
+	return -1;
+    Py_INCREF(st->globals);
+
+    if (!(st->environ_generator_type = PyType_FromSpec(&EnvironGeneratorSpec)))
+	return -1;
+    if (!(st->environ_type = PyType_FromSpec(&EnvironSpec)))
+	return -1;
+
+    if (!(env = PyObject_NEW(EnvironObject,
+			     (PyTypeObject *) st->environ_type)))
+	return -1;
+    env->gentype = (PyTypeObject *) st->environ_generator_type;
+    Py_INCREF(env->gentype);
+
+    if (PyModule_AddObject(module, "environ", (PyObject *) env) == -1) {
+	Py_DECREF(env);
+	return -1;
+    }
+    return 0;
+}
+
+static int
+zsh_module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    struct zsh_module_state *st = ZSH_MODULE_STATE(module);
+
+    Py_VISIT(st->environ_generator_type);
+    Py_VISIT(st->environ_type);
+    Py_VISIT(st->globals);
+    return 0;
+}
+
+static int
+zsh_module_clear(PyObject *module)
+{
+    struct zsh_module_state *st = ZSH_MODULE_STATE(module);
+
+    Py_CLEAR(st->environ_generator_type);
+    Py_CLEAR(st->environ_type);
+    Py_CLEAR(st->globals);
+    return 0;
+}
+
+static PyModuleDef_Slot zsh_module_slots[] = {
+    {Py_mod_exec, zsh_module_exec},
+    {0, NULL},
+};
+
+static struct PyModuleDef zshmodule = {
+    PyModuleDef_HEAD_INIT,
+    "zsh",                           /* Module name */
+    NULL,                            /* Module documentation */
+    sizeof(struct zsh_module_state), /* Size of per-module state */
+    ZshMethods,                      /* Module methods */
+    zsh_module_slots,                /* Multi-phase initialization slots */
+    zsh_module_traverse,             /* A traversal function to call during GC traversal */
+    zsh_module_clear,                /* A clear function to call during GC clearing */
+    NULL,                            /* A function to call during deallocation */
+};
+#else
+static PyTypeObject EnvironGeneratorType;
+static PyTypeObject EnvironType;
+
 static PyMappingMethods EnvironAsMapping = {
     (lenfunc) EnvironLength,
     (binaryfunc) EnvironItem,
     (objobjargproc) EnvironAssItem,
 };
 
-typedef struct {
-    PyObject_HEAD
-} EnvironObject;
-
 static int
 init_types(void)
 {
@@ -1706,9 +2362,421 @@ static struct PyModuleDef zshmodule = {
     NULL,       /* A function to call during deallocation */
 };
 #endif
+#endif
+
+/*
+ * Shared worker.
+ *
+ * "zpython -r" does not run code in the shell's own interpreter, but passes
+ * it over a unix domain socket to a per-user worker process which keeps its
+ * interpreter and imported modules around between requests.  The worker is
+ * a double-forked copy of the shell started on demand by the first request;
+ * it serves requests one at a time and exits after WORKER_IDLE_TIMEOUT
+ * seconds without requests or when code raises SystemExit.
+ *
+ * Wire protocol: the client sends a struct worker_request together with its
+ * standard input, output and error descriptors (SCM_RIGHTS), followed by
+ * cwdlen bytes of the current directory and codelen bytes of python code.
+ * The worker runs the code in a fresh namespace with the received
+ * descriptors as 0, 1 and 2, and answers with a struct worker_reply.
+ */
+
+#define WORKER_MAGIC		0x7a707977	/* "zpyw" */
+#define WORKER_IDLE_TIMEOUT	600
+#define WORKER_MAX_REQUEST	(16 * 1024 * 1024)
+
+struct worker_request {
+    uint32_t magic;
+    uint32_t cwdlen;
+    uint32_t codelen;
+};
+
+struct worker_reply {
+    uint32_t magic;
+    int32_t status;
+};
+
+/* Path of file in the per-user worker directory, or of the directory itself
+ * if file is empty.  Returns non-zero if the path does not fit. */
+
+static int
+worker_path(char *buf, size_t size, const char *file)
+{
+    char *tmpdir = zgetenv("TMPDIR");
+
+    if (!tmpdir || !*tmpdir)
+	tmpdir = "/tmp";
+    return snprintf(buf, size, "%s/zpython-%ld%s%s", tmpdir,
+		    (long) geteuid(), *file ? "/" : "", file) >= (int) size;
+}
+
+static int
+worker_dir(char *nam)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+
+    if (worker_path(dir, sizeof(dir), "")) {
+	zwarnnam(nam, "worker directory name too long");
+	return 1;
+    }
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+	zwarnnam(nam, "can't create worker directory %s: %e", dir, errno);
+	return 1;
+    }
+    if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	(st.st_mode & 077)) {
+	zwarnnam(nam, "worker directory %s is not private", dir);
+	return 1;
+    }
+    return 0;
+}
+
+static int
+worker_address(struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    return worker_path(sun->sun_path, sizeof(sun->sun_path), "socket");
+}
+
+static int
+worker_connect(void)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (worker_address(&sun))
+	return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	return -1;
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static int
+worker_run(int fd, int *fds, char *cwd, char *code)
+{
+    struct worker_reply rep;
+    PyObject *ns, *result;
+    int status = 0, exiting = 0, i;
+
+    for (i = 0; i < 3; i++)
+	dup2(fds[i], i);
+
+    if (chdir(cwd) == -1)
+	PySys_WriteStderr("zpython worker: can't change directory to %.200s\n",
+			  cwd);
+    if (!(ns = PyDict_New()) ||
+	PyDict_SetItemString(ns, "__builtins__", PyEval_GetBuiltins()) == -1 ||
+	!(result = PyRun_String(code, Py_file_input, ns, ns))) {
+	if (PyErr_ExceptionMatches(PyExc_SystemExit))
+	    exiting = 1;
+	else
+	    PyErr_PrintEx(0);
+	status = 1;
+    } else
+	Py_DECREF(result);
+    PyErr_Clear();
+    Py_XDECREF(ns);
+    flush_io();
+
+    if ((i = open("/dev/null", O_RDWR)) != -1) {
+	dup2(i, 0);
+	dup2(i, 1);
+	dup2(i, 2);
+	if (i > 2)
+	    close(i);
+    }
+
+    rep.magic = WORKER_MAGIC;
+    rep.status = status;
+    write_loop(fd, (char *) &rep, sizeof(rep));
+    return exiting;
+}
+
+/* Read one request from fd and run it; returns non-zero if the worker
+ * should exit. */
+
+static int
+worker_serve(int fd)
+{
+    struct worker_request req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    int fds[3] = { -1, -1, -1 }, ret = 0, i;
+    char *cwd, *code;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(req))
+	return 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+	    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (req.magic != WORKER_MAGIC || fds[2] == -1 ||
+	req.cwdlen > PATH_MAX || req.codelen > WORKER_MAX_REQUEST)
+	goto done;
+
+    cwd = zalloc(req.cwdlen + 1);
+    code = zalloc(req.codelen + 1);
+    if (read_loop(fd, cwd, req.cwdlen) == (ssize_t) req.cwdlen &&
+	read_loop(fd, code, req.codelen) == (ssize_t) req.codelen) {
+	cwd[req.cwdlen] = '\0';
+	code[req.codelen] = '\0';
+	ret = worker_run(fd, fds, cwd, code);
+    }
+    zfree(cwd, req.cwdlen + 1);
+    zfree(code, req.codelen + 1);
+
+ done:
+    for (i = 0; i < 3; i++)
+	if (fds[i] != -1)
+	    close(fds[i]);
+    return ret;
+}
+
+/*
+ * The worker is forked from whichever shell needed it first, but serves
+ * them all: it mustn't show that shell's parameters to the others.  Unset
+ * everything but special parameters, the python parameters (whose values
+ * belong to the old interpreter and are never looked at again) and what
+ * python and temporary files need from the environment.
+ */
+
+static int worker_dropped;
+
+static void
+worker_dropparam(HashNode hn, UNUSED(int flags))
+{
+    Param pm = (Param) hn;
+    struct specialparam *sp;
+
+    if (strpfx("PYTHON", pm->node.nam) || !strcmp(pm->node.nam, "TMPDIR") ||
+	!strcmp(pm->node.nam, "USER") || !strcmp(pm->node.nam, "LOGNAME"))
+	return;
+    for (sp = first_assigned_param; sp; sp = sp->next)
+	if (sp->pm == pm)
+	    return;
+    pm->node.flags &= ~PM_READONLY;
+    if (!unsetparam_pm(pm, 0, 1))
+	worker_dropped++;
+}
+
+static void
+worker_dropparams(void)
+{
+    /* Unsetting a local uncovers the one it hid: go round again */
+    locallevel = 0;
+    do {
+	worker_dropped = 0;
+	scanhashtable(paramtab, 0, 0, PM_SPECIAL|PM_UNSET,
+		      worker_dropparam, 0);
+    } while (worker_dropped);
+}
+
+static void
+worker_main(void)
+{
+    struct sockaddr_un sun;
+    struct pollfd pfd;
+    struct flock lck;
+    sigset_t set;
+    char lockname[PATH_MAX];
+    int i, lockfd, sfd;
+
+    closem(FDT_UNUSED, 1);
+    for (i = 3; i < 10; i++)
+	close(i);
+    if ((i = open("/dev/null", O_RDWR)) == -1)
+	_exit(1);
+    dup2(i, 0);
+    dup2(i, 1);
+    dup2(i, 2);
+    if (i > 2)
+	close(i);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+
+    /* Only one worker may own the socket: whoever holds the lock. */
+    if (worker_path(lockname, sizeof(lockname), "lock") ||
+	(lockfd = open(lockname, O_RDWR | O_CREAT, 0600)) == -1)
+	_exit(1);
+    memset(&lck, 0, sizeof(lck));
+    lck.l_type = F_WRLCK;
+    lck.l_whence = SEEK_SET;
+    if (fcntl(lockfd, F_SETLK, &lck) == -1)
+	_exit(0);
+
+    if (worker_address(&sun) ||
+	(sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	_exit(1);
+    unlink(sun.sun_path);
+    if (bind(sfd, (struct sockaddr *) &sun, sizeof(sun)) ||
+	listen(sfd, 16))
+	_exit(1);
+
+    worker_dropparams();
+
+    /*
+     * Neither may the interpreter of that shell be reused: start afresh,
+     * without running its exit handlers, in which the zsh module can't
+     * be imported.
+     */
+    if (Py_IsInitialized()) {
+	PyObject *atexit, *r;
+
+	PYTHON_RESTORE_THREAD;
+	PyOS_AfterFork_Child();
+	if ((atexit = PyImport_ImportModule("atexit"))) {
+	    if ((r = PyObject_CallMethod(atexit, "_clear", NULL)))
+		Py_DECREF(r);
+	    Py_DECREF(atexit);
+	}
+	PyErr_Clear();
+	untrack_output();
+	Py_Finalize();
+	pygilstate = PyGILState_UNLOCKED;
+    }
+    zpython_worker = 1;
+    if (init_python())
+	_exit(1);
+    PYTHON_RESTORE_THREAD;
+    flush_mode = FLUSH_ALWAYS;
+    /* There is no ZLE here to collect garbage while idle */
+    gc_mode = GC_AUTO;
+
+    pfd.fd = sfd;
+    pfd.events = POLLIN;
+    for (;;) {
+	int cfd;
+
+	if ((i = poll(&pfd, 1, WORKER_IDLE_TIMEOUT * 1000)) <= 0) {
+	    if (i == -1 && errno == EINTR)
+		continue;
+	    break;
+	}
+	if ((cfd = accept(sfd, NULL, NULL)) == -1)
+	    continue;
+	i = worker_serve(cfd);
+	close(cfd);
+	if (i)
+	    break;
+    }
+    unlink(sun.sun_path);
+    _exit(0);
+}
+
+static int
+start_worker(char *nam)
+{
+    pid_t pid;
+
+    if (worker_dir(nam))
+	return 1;
+    if ((pid = fork()) == -1) {
+	zwarnnam(nam, "can't start worker: %e", errno);
+	return 1;
+    }
+    if (!pid) {
+	setsid();
+	if (!fork())
+	    worker_main();
+	_exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    return 0;
+}
+
+/**/
+static int
+run_remote(char *nam, char *code)
+{
+    struct worker_request req;
+    struct worker_reply rep;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    int fd, len, tries, fds[3] = { 0, 1, 2 };
+    char *cwd;
+
+    if ((fd = worker_connect()) == -1) {
+	if (start_worker(nam))
+	    return 2;
+	for (tries = 0; (fd = worker_connect()) == -1 && tries < 200; tries++)
+	    zsleep(10000);
+	if (fd == -1) {
+	    zwarnnam(nam, "can't connect to worker: %e", errno);
+	    return 2;
+	}
+    }
+
+    code = unmetafy(dupstring(code), &len);
+    cwd = unmeta(pwd);
+    req.magic = WORKER_MAGIC;
+    req.cwdlen = strlen(cwd);
+    req.codelen = len;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+    fflush(stderr);
+    if (sendmsg(fd, &msg, 0) != sizeof(req) ||
+	write_loop(fd, cwd, req.cwdlen) < 0 ||
+	write_loop(fd, code, req.codelen) < 0) {
+	zwarnnam(nam, "failed to send request to worker: %e", errno);
+	close(fd);
+	return 2;
+    }
+    if (read_loop(fd, (char *) &rep, sizeof(rep)) != sizeof(rep) ||
+	rep.magic != WORKER_MAGIC) {
+	zwarnnam(nam, "no reply from worker");
+	close(fd);
+	return 2;
+    }
+    close(fd);
+    return rep.status;
+}
 
 static struct builtin bintab[] = {
-    BUILTIN("zpython", 0, do_zpython,  1, 1, 0, NULL, NULL),
+    BUILTIN("zpython", 0, do_zpython,  1, 1, 0, "r", NULL),
 };
 
 static struct features module_features = {
@@ -1741,6 +2809,18 @@ enables_(Module m, int **enables)
     return handlefeatures(m, &module_features, enables);
 }
 
+#ifdef ZPYTHON_MULTIPHASE
+static PyObject *
+PyInit_zsh(void)
+{
+    if (zpython_worker) {
+	PyErr_SetString(PyExc_ImportError,
+			"the zsh module is not available in the zpython worker");
+	return NULL;
+    }
+    return PyModuleDef_Init(&zshmodule);
+}
+#else
 static int
 zsh_init_globals(PyObject *zsh_globals)
 {
@@ -1751,6 +2831,7 @@ zsh_init_globals(PyObject *zsh_globals)
 
     if (!(environ = PyObject_NEW(EnvironObject, &EnvironType)))
 	return 1;
+    environ->gentype = &EnvironGeneratorType;
 
     if (PyDict_SetItemString(zsh_globals, "environ", (PyObject *)environ) == -1)
 	return 1;
@@ -1763,6 +2844,11 @@ PyInit_zsh()
     PyObject *module_globals;
     PyObject *module;
 
+    if (zpython_worker) {
+	PyErr_SetString(PyExc_ImportError,
+			"the zsh module is not available in the zpython worker");
+	return NULL;
+    }
 #if PY_MAJOR_VERSION >= 3
     if (!(module = PyModule_Create(&zshmodule)))
 	return NULL;
@@ -1777,17 +2863,49 @@ PyInit_zsh()
 
     return module;
 }
+#endif
 
-/**/
-int
-boot_(UNUSED(Module m))
+/*
+ * Return non-zero if the interpreter may outlive the module.  The state of
+ * the zsh python module lives in the module object, but its methods and
+ * types still point into our code, so this is only safe if that (and
+ * libpython with it) stays mapped after zsh unloads the module: pin
+ * ourselves with RTLD_NODELETE.  Reloading the module then picks up the
+ * running interpreter.
+ */
+
+static int
+keep_interpreter(void)
+{
+#ifdef MODULE
+# if defined(HAVE_DLFCN_H) && defined(RTLD_NODELETE)
+    static int pinned;
+    Dl_info info;
+
+    if (!pinned && dladdr((void *) keep_interpreter, &info) &&
+	info.dli_fname && dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE))
+	pinned = 1;
+    return pinned;
+# else
+    return 0;
+# endif
+#else
+    return 1;
+#endif
+}
+
+static int
+init_python(void)
 {
 #if PY_MAJOR_VERSION >= 3
     size_t zsh_name_size = strlen(argzero);
     wchar_t *zsh_name_wchar;
     wchar_t *argv[2];
     wchar_t *program_name;
-    if ((zsh_name_wchar = zhalloc(zsh_name_size + 1)) == NULL)
+    /* Python keeps the program name: it must not live on the heap, which
+     * may be popped long before the interpreter is finalized */
+    if ((zsh_name_wchar = zalloc((zsh_name_size + 1) * sizeof(wchar_t)))
+	== NULL)
 	return 1;
     mbstowcs(zsh_name_wchar, argzero, zsh_name_size);
     zsh_name_wchar[zsh_name_size] = '\0';
@@ -1805,16 +2923,37 @@ boot_(UNUSED(Module m))
     Py_InitializeEx(0);
     PYTHON_INIT(1);
     PySys_SetArgvEx(1, argv, 0);
-    if (!(globals = PyModule_GetDict(PyImport_AddModule("__main__"))))
+#ifndef ZPYTHON_MULTIPHASE
+    if (!(zsh_static_state.globals =
+	  PyModule_GetDict(PyImport_AddModule("__main__"))))
 	return 1;
+#endif
     PYTHON_FINISH;
     return 0;
 }
 
+/**/
+int
+boot_(UNUSED(Module m))
+{
+    (void) keep_interpreter();
+    addhookfunc("after_command", flushhook);
+    addhookfunc("before_fork", flushhook);
+    addhookfunc("before_exec", flushhook);
+    addhookfunc("exit", flushhook);
+    addhookfunc("idle", gcidlehook);
+    return 0;
+}
+
 /**/
 int
 cleanup_(Module m)
 {
+    deletehookfunc("after_command", flushhook);
+    deletehookfunc("before_fork", flushhook);
+    deletehookfunc("before_exec", flushhook);
+    deletehookfunc("exit", flushhook);
+    deletehookfunc("idle", gcidlehook);
     if (Py_IsInitialized()) {
 	struct specialparam *cur_sp = first_assigned_param;
 
@@ -1851,9 +2990,22 @@ cleanup_(Module m)
 	     * sp->next */
 	    cur_sp = next_sp;
 	}
-	PYTHON_RESTORE_THREAD;
-	Py_Finalize();
-	pygilstate = PyGILState_UNLOCKED;
+	if (keep_interpreter()) {
+	    flushhook(NULL, NULL);
+	    /* Nobody would collect garbage any more */
+	    if (gc_mode == GC_IDLE) {
+		PYTHON_RESTORE_THREAD;
+		set_gc_mode(GC_AUTO);
+		PyErr_Clear();
+		PYTHON_SAVE_THREAD;
+	    }
+	}
+	else {
+	    PYTHON_RESTORE_THREAD;
+	    untrack_output();
+	    Py_Finalize();
+	    pygilstate = PyGILState_UNLOCKED;
+	}
     }
     return setfeatureenables(m, &module_features, NULL);
 }
@@ -1288,6 +1288,7 @@ addcompparams(struct compparam *cp, Param *pp)
 
 	*pp = pm;
 	pm->level = locallevel + 1;
+	scopeparam(pm);
 	if ((pm->u.data = cp->var)) {
 	    switch(PM_TYPE(cp->type)) {
 	    case PM_SCALAR:
@@ -1328,6 +1329,7 @@ makecompparams(void)
     comprpms[CPN_COMPSTATE] = cpm;
     tht = paramtab;
     cpm->level = locallevel + 1;
+    scopeparam(cpm);
     cpm->gsu.h = &compstate_gsu;
     cpm->u.hash = paramtab = newparamtable(31, COMPSTATENAME);
     addcompparams(compkparams, compkpms);
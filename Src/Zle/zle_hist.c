@@ -68,6 +68,13 @@ Keymap isearch_keymap;
  */
 #define GETZLETEXT(ent)	((ent)->zle_text ? (ent)->zle_text : (ent)->node.nam)
 
+/*
+ * The numbers of the history lines which have text of their own in
+ * zle, which the history index doesn't know about.
+ */
+static zlong *zle_edits;
+static int zle_nedits, zle_editsize;
+
 /**/
 void
 remember_edits(void)
@@ -80,6 +87,14 @@ remember_edits(void)
 	if (!ent->zle_text || strcmp(line, ent->zle_text) != 0) {
 	    if (ent->zle_text)
 		free(ent->zle_text);
+	    else {
+		if (zle_nedits == zle_editsize) {
+		    zle_editsize = zle_editsize ? 2 * zle_editsize : 16;
+		    zle_edits = zrealloc(zle_edits,
+					 zle_editsize * sizeof(zlong));
+		}
+		zle_edits[zle_nedits++] = ent->histnum;
+	    }
 	    ent->zle_text = zlemetaline ? ztrdup(line) : line;
 	} else if (!zlemetaline)
 	    free(line);
@@ -98,6 +113,7 @@ forget_edits(void)
 	    he->zle_text = NULL;
 	}
     }
+    zle_nedits = 0;
 }
 
 
@@ -213,6 +229,43 @@ zlinefind(char *haystack, int pos, char *needle, int dir, int sens)
 }
 
 
+/*
+ * Move from he in direction dir to the next history line that might
+ * contain str, going straight there using the index of the history
+ * if we can.  Return NULL if there are no more lines.
+ */
+
+static Histent
+findhistline(Histent he, int dir, char *str)
+{
+    Histent found;
+    zlong num = he->histnum;
+
+    if (!histindexable(str))
+	return movehistent(he, dir, hist_skip_flags);
+    found = histindexfind(he, dir, str, hist_skip_flags);
+    /* Lines edited since zle started need looking at, too. */
+    for (;;) {
+	zlong next = -1;
+	int i;
+
+	for (i = 0; i < zle_nedits; i++) {
+	    zlong ev = zle_edits[i];
+	    if ((dir > 0 ? ev > num : ev < num) &&
+		(!found || (dir > 0 ? ev < found->histnum :
+			    ev > found->histnum)) &&
+		(next < 0 || (dir > 0 ? ev < next : ev > next)))
+		next = ev;
+	}
+	if (next < 0)
+	    return found;
+	if ((he = histindexent(next)) && !(he->node.flags & hist_skip_flags))
+	    return he;
+	num = next;
+    }
+}
+
+
 /*** Widgets ***/
 
 
@@ -684,7 +737,9 @@ insertlastword(char **args)
 	nwords = countlinknodes(l);
     } else {
 	/* Some stored line. */
-	if (!(he = quietgethist(evhist)) || !he->nwords) {
+	if ((he = quietgethist(evhist)))
+	    gethistwords(he);
+	if (!he || !he->nwords) {
 	    unmetafy_line();
 	    return 1;
 	}
@@ -1392,7 +1447,10 @@ doisearch(char **args, int dir, int pattern)
 		 * the history to try again.
 		 */
 		if (!(zlereadflags & ZLRF_HISTORY)
-		 || !(he = movehistent(he, dir, hist_skip_flags))) {
+		 || !(he = pattern ?
+		      movehistent(he, dir, hist_skip_flags) :
+		      findhistline(he, dir,
+				   sbuf[0] == '^' ? sbuf + 1 : sbuf))) {
 		    if (sbptr == (int)isrch_spots[top_spot-1].len
 		     && (isrch_spots[top_spot-1].flags >> ISS_NOMATCH_SHIFT))
 			top_spot--;
@@ -1720,6 +1778,273 @@ doisearch(char **args, int dir, int pattern)
     return aborted ? 3 : nomatch;
 }
 
+/*
+ * Fuzzy history search.  The search string matches a line if its
+ * characters appear in the line in the same order, though not
+ * necessarily next to each other.  As for the incremental search, a
+ * lowercase character also matches the uppercase one.  Both strings
+ * are metafied.
+ */
+
+static int
+fuzzymatch(char *text, char *str)
+{
+#ifdef MULTIBYTE_SUPPORT
+    mbstate_t tstate, sstate;
+    wint_t twc, swc;
+    int tlen, slen;
+
+    if (!*str)
+	return 1;
+    memset(&tstate, 0, sizeof(tstate));
+    memset(&sstate, 0, sizeof(sstate));
+    slen = mb_metacharlenconv_r(str, &swc, &sstate);
+    while (*text) {
+	if ((tlen = mb_metacharlenconv_r(text, &twc, &tstate)) <= 0)
+	    tlen = 1;
+	if (twc == WEOF || swc == WEOF ?
+	    tlen == slen && !memcmp(text, str, tlen) :
+	    twc == swc || towlower(twc) == swc) {
+	    if (!*(str += slen))
+		return 1;
+	    slen = mb_metacharlenconv_r(str, &swc, &sstate);
+	}
+	text += tlen;
+    }
+#else
+    while (*str && *text) {
+	int tc = STOUC(*text == Meta ? text[1] ^ 32 : *text);
+	int sc = STOUC(*str == Meta ? str[1] ^ 32 : *str);
+
+	if (tc == sc || tolower(tc) == sc)
+	    str += (*str == Meta) ? 2 : 1;
+	text += (*text == Meta) ? 2 : 1;
+    }
+#endif
+    return !*str;
+}
+
+#define FUZZY_PROMPT		"XXXXXXX fuzzy-search: "
+#define FUZZY_MAX		64
+
+/**/
+int
+historyfuzzysearch(char **args)
+{
+    /* The distinct lines of the history, best first */
+    Histent *ents;
+    /*
+     * For each line, how many characters of the search string it
+     * matches:  it's a match if that's all of them.  As the string
+     * grows only the lines still matching need looking at.
+     */
+    int *depth;
+    /* Where each character of the search string starts */
+    int spos[FUZZY_MAX];
+    /* The selected match and the first one listed */
+    int sel = 0, top = 0;
+    int nents, nmatch = 0, sbptr = 0, sct = 0, i;
+    int feep = 0, aborted = 0, listed = 0, savekeys = -1;
+    int ohl = histline, ocs = zlecs;
+    char *ibuf, *sbuf, *okeymap;
+    Histent cur = NULL;
+    Thingy cmd;
+
+    if (!(zlereadflags & ZLRF_HISTORY) ||
+	!(ents = histranked(hist_skip_flags, &nents)))
+	return 1;
+    depth = (int *)zshcalloc(nents * sizeof(int));
+
+    selectlocalmap(isearch_keymap);
+    clearlist = 1;
+
+    if (*args) {
+	int len;
+	char *arg;
+	savekeys = kungetct;
+	arg = getkeystring(*args, &len, GETKEYS_BINDKEY, NULL);
+	ungetbytes(arg, len);
+    }
+
+    ibuf = (char *)zhalloc(FIRST_SEARCH_CHAR + 2 * FUZZY_MAX
+#ifdef MULTIBYTE_SUPPORT
+			   * MB_CUR_MAX
+#endif
+			   + 2);
+    strcpy(ibuf, FUZZY_PROMPT);
+    memcpy(ibuf, FAILING_TEXT, BAD_TEXT_LEN);
+    sbuf = ibuf + FIRST_SEARCH_CHAR;
+    okeymap = ztrdup(curkeymapname);
+    selectkeymap("main", 1);
+
+    for (;;) {
+	LinkList l;
+	Histent he = NULL;
+	int rows = zterm_lines - nlnct - 1, max = getiparam("LISTMAX");
+
+	if (max > 0 && rows > max)
+	    rows = max;
+	if (rows < 1)
+	    rows = 1;
+	/*
+	 * List as many matches as fit from the first one listed last
+	 * time, unless that leaves out the selected one.
+	 */
+	for (;;) {
+	    int k = 0, used = 0, shown = 0;
+
+	    l = newlinklist();
+	    for (i = 0; i < nents; i++) {
+		if (depth[i] != sct)
+		    continue;
+		if (k == sel)
+		    he = ents[i];
+		if (k >= top && used < rows) {
+		    char *t = dyncat(k == sel ? "> " : "  ",
+				     GETZLETEXT(ents[i]));
+		    int n = 1 + strlen(t) / zterm_columns;
+
+		    if (used && used + n > rows)
+			used = rows;
+		    else {
+			addlinknode(l, t);
+			used += n;
+			if (k == sel)
+			    shown = 1;
+		    }
+		}
+		k++;
+	    }
+	    nmatch = k;
+	    if (!nmatch || shown || top == sel)
+		break;
+	    top = sel;
+	}
+	if (he && he != cur)
+	    zle_setline(cur = he);
+	statusline = nmatch ? ibuf + NORM_PROMPT_POS : ibuf;
+	sbuf[sbptr] = '_';
+	sbuf[sbptr+1] = '\0';
+	if (nmatch) {
+	    int zmultsav = zmult;
+
+	    zmult = 1;
+	    dolistlist(l, 0);
+	    listed = 1;
+	    showinglist = clearlist = 0;
+	    zmult = zmultsav;
+	} else if (listed) {
+	    clearlist = listshown = 1;
+	    listed = 0;
+	}
+	if (feep) {
+	    handlefeep(zlenoargs);
+	    feep = 0;
+	}
+	zrefresh();
+	sbuf[sbptr] = '\0';
+
+	if (!(cmd = getkeycmd()) || cmd == Th(z_sendbreak)) {
+	    aborted = 1;
+	    break;
+	}
+	if (cmd == Th(z_clearscreen)) {
+	    clearscreen(zlenoargs);
+	    listed = 0;
+	} else if (cmd == Th(z_redisplay)) {
+	    redisplay(zlenoargs);
+	    listed = 0;
+	} else if (cmd == Th(z_historyfuzzysearch) ||
+		   cmd == Th(z_historyincrementalsearchbackward) ||
+		   cmd == Th(z_downlineorhistory) ||
+		   cmd == Th(z_vidownlineorhistory) ||
+		   cmd == Th(z_downlineorsearch) ||
+		   cmd == Th(z_downhistory)) {
+	    if (sel + 1 < nmatch)
+		sel++;
+	    else
+		feep = 1;
+	} else if (cmd == Th(z_historyincrementalsearchforward) ||
+		   cmd == Th(z_uplineorhistory) ||
+		   cmd == Th(z_viuplineorhistory) ||
+		   cmd == Th(z_uplineorsearch) ||
+		   cmd == Th(z_uphistory)) {
+	    if (sel) {
+		if (--sel < top)
+		    top = sel;
+	    } else
+		feep = 1;
+	} else if (cmd == Th(z_backwarddeletechar) ||
+		   cmd == Th(z_vibackwarddeletechar)) {
+	    if (sct) {
+		sbptr = spos[--sct];
+		for (i = 0; i < nents; i++)
+		    if (depth[i] > sct)
+			depth[i] = sct;
+		sel = top = 0;
+	    } else
+		feep = 1;
+	} else if (cmd == Th(z_acceptsearch)) {
+	    break;
+	} else {
+	    if (cmd == Th(z_viquotedinsert) || cmd == Th(z_quotedinsert)) {
+		if (getfullchar(0) == ZLEEOF) {
+		    feep = 1;
+		    continue;
+		}
+	    } else if (cmd == Th(z_selfinsertunmeta)) {
+		fixunmeta();
+	    } else if (cmd == Th(z_magicspace)) {
+		fixmagicspace();
+	    } else if (cmd == Th(z_selfinsert)) {
+#ifdef MULTIBYTE_SUPPORT
+		if (!lastchar_wide_valid)
+		    if (getrestchar(lastchar, NULL, NULL) == WEOF) {
+			feep = 1;
+			continue;
+		    }
+#else
+		;
+#endif
+	    } else {
+		ungetkeycmd();
+		break;
+	    }
+	    if (sct == FUZZY_MAX) {
+		feep = 1;
+		continue;
+	    }
+	    spos[sct] = sbptr;
+	    sbptr += zlecharasstring(LASTFULLCHAR, sbuf + sbptr);
+	    sbuf[sbptr] = '\0';
+	    feep = 1;
+	    for (i = 0; i < nents; i++)
+		if (depth[i] == sct && fuzzymatch(GETZLETEXT(ents[i]), sbuf)) {
+		    depth[i] = sct + 1;
+		    feep = 0;
+		}
+	    sct++;
+	    sel = top = 0;
+	}
+    }
+    if (aborted && cur) {
+	zle_setline(quietgethist(ohl));
+	zlecs = ocs;
+    }
+    statusline = NULL;
+    if (listed)
+	clearlist = listshown = 1;
+    selectkeymap(okeymap, 1);
+    zsfree(okeymap);
+    zfree(ents, nents * sizeof(Histent));
+    zfree(depth, nents * sizeof(int));
+    if (savekeys >= 0 && kungetct > savekeys)
+	kungetct = savekeys;
+    selectlocalmap(NULL);
+
+    return aborted ? 3 : !nmatch;
+}
+
 static Histent
 infernexthist(Histent he, UNUSED(char **args))
 {
@@ -1971,7 +2296,8 @@ virepeatsearch(UNUSED(char **args))
     if (!(he = quietgethist(histline)))
 	return 1;
     metafy_line();
-    while ((he = movehistent(he, visrchsense, hist_skip_flags))) {
+    while ((he = findhistline(he, visrchsense, *visrchstr == '^' ?
+			      visrchstr + 1 : visrchstr))) {
 	if (isset(HISTFINDNODUPS) && he->node.flags & HIST_DUP)
 	    continue;
 	zt = GETZLETEXT(he);
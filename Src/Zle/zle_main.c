@@ -878,6 +878,8 @@ getbyte(long do_keytmout, int *timeout, int full)
     if (kungetct)
 	ret = STOUC(kungetbuf[--kungetct]);
     else {
+	/* About to wait for the user: modules may do deferred work */
+	runhookdef(IDLEHOOK, NULL);
 	for (;;) {
 	    int q = queue_signal_level();
 	    dont_queue_signals();
@@ -204,6 +204,7 @@ makezleparams(int ro)
 	DPUTS(!pm, "param not set in makezleparams");
 
 	pm->level = locallevel + 1;
+	scopeparam(pm);
 	pm->u.data = zp->data;
 	switch(PM_TYPE(zp->type)) {
 	    case PM_SCALAR:
@@ -225,6 +226,7 @@ makezleparams(int ro)
 	    PM_LOCAL|PM_REMOVABLE);
     reg_param->gsu.h = &registers_gsu;
     reg_param->level = locallevel + 1;
+    scopeparam(reg_param);
 }
 
 /* Special unset function for ZLE special parameters: act like the standard *
@@ -2592,6 +2592,19 @@ printfmt(char *fmt, int n, int dopr, int doesc)
 /**/
 int
 listlist(LinkList l)
+{
+    return dolistlist(l, 1);
+}
+
+/*
+ * List the strings in l below the command line.  If sorted is set,
+ * they are sorted and arranged in columns; otherwise they are shown
+ * one to a line in the order given.
+ */
+
+/**/
+int
+dolistlist(LinkList l, int sorted)
 {
     int num = countlinknodes(l);
     VARARR(char *, data, (num + 1));
@@ -2606,8 +2619,9 @@ listlist(LinkList l)
 	*p = (char *) getdata(node);
     *p = NULL;
 
-    strmetasort((char **)data, SORTIT_IGNORING_BACKSLASHES |
-		(isset(NUMERICGLOBSORT) ? SORTIT_NUMERICALLY : 0), NULL);
+    if (sorted)
+	strmetasort((char **)data, SORTIT_IGNORING_BACKSLASHES |
+		    (isset(NUMERICGLOBSORT) ? SORTIT_NUMERICALLY : 0), NULL);
 
     for (p = data, lenp = lens; *p; p++, lenp++) {
 	len = *lenp = ZMB_nicewidth(*p) + 2;
@@ -2617,7 +2631,8 @@ listlist(LinkList l)
 	    shortest = len;
 	totl += len;
     }
-    if ((ncols = ((zterm_columns + 2) / longest))) {
+    ncols = sorted ? (zterm_columns + 2) / longest : 0;
+    if (ncols) {
 	int tlines = 0, tline, tcols = 0, maxlen, nth, width;
 
 	nlines = (num + ncols - 1) / ncols;
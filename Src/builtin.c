@@ -71,7 +71,7 @@ static struct builtin builtins[] =
      * But that's actually not useful, so it's more consistent to
      * cause an error.
      */
-    BUILTIN("fc", 0, bin_fc, 0, -1, BIN_FC, "aAdDe:EfiIlLmnpPrRst:W", NULL),
+    BUILTIN("fc", 0, bin_fc, 0, -1, BIN_FC, "aAc:dDe:EfiIlLmnpPrRst:Wx:X", NULL),
     BUILTIN("fg", 0, bin_fg, 0, -1, BIN_FG, NULL, NULL),
     BUILTIN("float", BINF_PLUSOPTS | BINF_MAGICEQUALS | BINF_PSPECIAL | BINF_ASSIGN, (HandlerFunc)bin_typeset, 0, -1, 0, "E:%F:%HL:%R:%Z:%ghlp:%rtux", "E"),
     BUILTIN("functions", BINF_PLUSOPTS, bin_functions, 0, -1, 0, "ckmMstTuUWx:z", NULL),
@@ -83,7 +83,7 @@ static struct builtin builtins[] =
     BUILTIN("hashinfo", 0, bin_hashinfo, 0, 0, 0, NULL, NULL),
 #endif
 
-    BUILTIN("history", 0, bin_fc, 0, -1, BIN_FC, "adDEfiLmnpPrt:", "l"),
+    BUILTIN("history", 0, bin_fc, 0, -1, BIN_FC, "ac:dDEfiLmnpPrt:x:X", "l"),
     BUILTIN("integer", BINF_PLUSOPTS | BINF_MAGICEQUALS | BINF_PSPECIAL | BINF_ASSIGN, (HandlerFunc)bin_typeset, 0, -1, 0, "HL:%R:%Z:%ghi:%lp:%rtux", "i"),
     BUILTIN("jobs", 0, bin_fg, 0, -1, BIN_JOBS, "dlpZrs", NULL),
     BUILTIN("kill", BINF_HANDLES_OPTS, bin_kill, 0, -1, 0, NULL, NULL),
@@ -92,7 +92,7 @@ static struct builtin builtins[] =
     BUILTIN("log", 0, bin_log, 0, 0, 0, NULL, NULL),
     BUILTIN("logout", 0, bin_break, 0, 1, BIN_LOGOUT, NULL, NULL),
 
-#if defined(ZSH_MEM) & defined(ZSH_MEM_DEBUG)
+#ifdef ZSH_MEM_DEBUG
     BUILTIN("mem", 0, bin_mem, 0, 0, 0, "v", NULL),
 #endif
 
@@ -1752,11 +1752,34 @@ static int
 fclist(FILE *f, Options ops, zlong first, zlong last,
        struct asgment *subs, Patprog pprog, int is_command)
 {
-    int fclistdone = 0, xflags = 0;
+    int fclistdone = 0, xflags = 0, status = HISTSTAT_ANY, filter = 0;
     zlong tmp;
-    char *s, *tdfmt, *timebuf;
+    char *s, *tdfmt, *timebuf, *cwd = NULL;
     Histent ent;
 
+    /* -c and -x or -X restrict the events to a directory or status */
+    if (OPT_ISSET(ops,'c')) {
+	cwd = OPT_ARG(ops,'c');
+	cwd = (*cwd == '/') ? dupstring(cwd) : zhtricat(pwd, "/", cwd);
+	fixdir(cwd);
+	filter = 1;
+    }
+    if (OPT_ISSET(ops,'x')) {
+	char *arg = OPT_ARG(ops,'x'), *eptr;
+
+	status = (int)zstrtol(arg, &eptr, 10);
+	if (!*arg || *eptr || status < 0) {
+	    zwarnnam("fc", "invalid exit status: %s", arg);
+	    if (f != stdout)
+		fclose(f);
+	    return 1;
+	}
+	filter = 1;
+    } else if (OPT_ISSET(ops,'X')) {
+	status = HISTSTAT_FAILED;
+	filter = 1;
+    }
+
     /* reverse range if required */
     if (OPT_ISSET(ops,'r')) {
 	tmp = last;
@@ -1810,7 +1833,12 @@ fclist(FILE *f, Options ops, zlong first, zlong last,
 	xflags |= HIST_READ;
     }
 
-    for (;;) {
+    /* with a filter, only the events that pass are visited */
+    if (filter && ((ent->node.flags & xflags) ||
+		   !histfiltermatch(ent, cwd, status)))
+	ent = histindexfilter(ent, first < last ? 1 : -1, cwd, status, xflags);
+    while (ent && (first < last ? ent->histnum <= last :
+		   ent->histnum >= last)) {
 	if (ent->node.flags & xflags)
 	    s = NULL;
 	else
@@ -1856,15 +1884,12 @@ fclist(FILE *f, Options ops, zlong first, zlong last,
 		putc('\n', f);
 	    }
 	}
-	/* move on to the next history line, or quit the loop */
-	if (first < last) {
-	    if (!(ent = down_histent(ent)) || ent->histnum > last)
-		break;
-	}
-	else {
-	    if (!(ent = up_histent(ent)) || ent->histnum < last)
-		break;
-	}
+	/* move on to the next history line */
+	if (filter)
+	    ent = histindexfilter(ent, first < last ? 1 : -1,
+				  cwd, status, xflags);
+	else
+	    ent = first < last ? down_histent(ent) : up_histent(ent);
     }
 
     /* final processing */
@@ -1873,7 +1898,7 @@ fclist(FILE *f, Options ops, zlong first, zlong last,
     if (!fclistdone) {
 	if (subs)
 	    zwarnnam("fc", "no substitutions performed");
-	else if (xflags || pprog)
+	else if (xflags || pprog || filter)
 	    zwarnnam("fc", "no matching events found");
 	return 1;
     }
@@ -2349,7 +2374,7 @@ typeset_single(char *cname, char *pname, Param pm, UNUSED(int func),
 	 * Maybe it would be easier to create a new struct but copy
 	 * the get/set methods.
 	 */
-	tpm = (Param) zshcalloc(sizeof *tpm);
+	tpm = (Param) zslabcalloc(sizeof *tpm, MEMTAG_PARAM);
 
 	tpm->node.nam = pm->node.nam;
 	if (pm->ename &&
@@ -2522,6 +2547,7 @@ typeset_single(char *cname, char *pname, Param pm, UNUSED(int func),
 	pm->level = keeplocal;
     else if (on & PM_LOCAL)
 	pm->level = locallevel;
+    scopeparam(pm);
     if (ASG_VALUEP(asg) && !dont_set) {
 	Param ipm = pm;
 	if (pm->node.flags & (PM_ARRAY|PM_HASHED)) {
@@ -3488,7 +3514,7 @@ bin_functions(char *name, char **argv, Options ops, int func)
 		DPUTS(!shf->funcdef,
 		      "BUG: Calling autoload from empty function");
 	    } else {
-		shf = (Shfunc) zshcalloc(sizeof *shf);
+		shf = (Shfunc) zslabcalloc(sizeof *shf, MEMTAG_HASHNODE);
 		shfunctab->addnode(shfunctab, ztrdup(funcname), shf);
 	    }
 	    if (*argv) {
@@ -3608,7 +3634,7 @@ bin_functions(char *name, char **argv, Options ops, int func)
 
 	    /* Add a new undefined (autoloaded) function to the *
 	     * hash table with the corresponding flags set.     */
-	    shf = (Shfunc) zshcalloc(sizeof *shf);
+	    shf = (Shfunc) zslabcalloc(sizeof *shf, MEMTAG_HASHNODE);
 	    shf->node.flags = on;
 	    shf->funcdef = mkautofn(shf);
 	    shfunc_set_sticky(shf);
@@ -4140,12 +4166,12 @@ bin_hash(char *name, char **argv, Options ops, UNUSED(int func))
 			returnval = 1;
 			continue;
 		    } else {
-			Nameddir nd = hn = zshcalloc(sizeof *nd);
+			Nameddir nd = hn = zslabcalloc(sizeof *nd, MEMTAG_HASHNODE);
 			nd->node.flags = 0;
 			nd->dir = ztrdup(asg->value.scalar);
 		    }
 		} else {
-		    Cmdnam cn = hn = zshcalloc(sizeof *cn);
+		    Cmdnam cn = hn = zslabcalloc(sizeof *cn, MEMTAG_HASHNODE);
 		    cn->node.flags = HASHED;
 		    cn->u.cmd = ztrdup(asg->value.scalar);
 		}
@@ -4900,27 +4926,28 @@ bin_print(char *name, char **args, Options ops, int func)
 		    wordsize = 0;
 		    histsplitwords(*args, &words, &wordsize, &nwords, 1);
 		    ent = prepnexthistent();
-		    ent->words = (short *)zalloc(nwords*sizeof(short));
-		    memcpy(ent->words, words, nwords*sizeof(short));
-		    free(words);
 		    ent->nwords = nwords/2;
+		    ent->words = histwordsdup(words, ent->nwords);
+		    free(words);
 		} else {
+		    short *words = (short *)zhalloc(nwords*2*sizeof(short));
+
 		    ent = prepnexthistent();
-		    ent->words = (short *)zalloc(nwords*2*sizeof(short));
-		    ent->nwords = nwords;
 		    nlen = iwords = 0;
 		    for (pargs = args; *pargs; pargs++) {
-			ent->words[iwords++] = nlen;
+			words[iwords++] = nlen;
 			nlen += strlen(*pargs);
-			ent->words[iwords++] = nlen;
+			words[iwords++] = nlen;
 			nlen++;
 		    }
+		    ent->nwords = nwords;
+		    ent->words = histwordsdup(words, nwords);
 		}
 	    } else {
 		ent = prepnexthistent();
 		ent->words = (short *)NULL;
 	    }
-	    ent->node.nam = zjoin(args, ' ', 0);
+	    ent->node.nam = histstrdup(zjoin(args, ' ', 1));
 	    ent->stim = ent->ftim = time(NULL);
 	    ent->node.flags = 0;
 	    addhistnode(histtab, ent->node.nam, ent);
@@ -5401,7 +5428,8 @@ bin_print(char *name, char **args, Options ops, int func)
 		    setsparam(OPT_ARG(ops, 'v'), stringval);
 		} else {
 		    ent = prepnexthistent();
-		    ent->node.nam = stringval;
+		    ent->node.nam = histstrdup(stringval);
+		    zsfree(stringval);
 		    ent->stim = ent->ftim = time(NULL);
 		    ent->node.flags = 0;
 		    ent->words = (short *)NULL;
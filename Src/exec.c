@@ -320,6 +320,8 @@ zfork(struct timeval *tv)
     }
     if (tv)
 	gettimeofday(tv, &dummy_tz);
+    /* Let modules with buffered output flush it so it isn't duplicated */
+    runhookdef(BEFOREFORKHOOK, NULL);
     /*
      * Queueing signals is necessary on Linux because fork()
      * manipulates mutexes, leading to deadlock in memory
@@ -727,6 +729,7 @@ execute(LinkList args, int flags, int defpath)
      * here, which should be visible to external processes.
      */
     closem(FDT_XTRACE, 0);
+    runhookdef(BEFOREEXECHOOK, NULL);
 #ifndef FD_CLOEXEC
     if (SHTTY != -1) {
 	close(SHTTY);
@@ -863,7 +866,8 @@ findcmd(char *arg0, int docopy, int default_path)
 	    !strncmp(arg0, "../", 3)) {
 	    return NULL;
 	}
-    }
+    } else if (!cn && iscmdmiss(arg0))
+	return NULL;
     if (cn) {
 	char nn[PATH_MAX+1];
 
@@ -895,6 +899,8 @@ findcmd(char *arg0, int docopy, int default_path)
 	strcpy(z, arg0);
 	RET_IF_COM(buf);
     }
+    if (!s)
+	addcmdmiss(arg0);
     return NULL;
 }
 
@@ -957,10 +963,12 @@ hashcmd(char *arg0, char **pp)
 {
     Cmdnam cn;
     char *s, buf[PATH_MAX+1];
-    char **pq;
+    char **pq, **pp0 = pp;
 
     if (*arg0 == '/')
         return NULL;
+    if (pp == path && iscmdmiss(arg0))
+	return NULL;
     for (; *pp; pp++)
 	if (**pp == '/') {
 	    s = buf;
@@ -973,10 +981,13 @@ hashcmd(char *arg0, char **pp)
 		break;
 	}
 
-    if (!*pp)
+    if (!*pp) {
+	if (pp0 == path)
+	    addcmdmiss(arg0);
 	return NULL;
+    }
 
-    cn = (Cmdnam) zshcalloc(sizeof *cn);
+    cn = (Cmdnam) zslabcalloc(sizeof *cn, MEMTAG_HASHNODE);
     cn->node.flags = 0;
     cn->u.name = pp;
     cmdnamtab->addnode(cmdnamtab, ztrdup(arg0), cn);
@@ -985,6 +996,7 @@ hashcmd(char *arg0, char **pp)
 	for (pq = pathchecked; pq <= pp; pq++)
 	    hashdir(pq);
 	pathchecked = pp + 1;
+	savehashcache();
     }
 
     return cn;
@@ -4331,7 +4343,7 @@ save_params(Estate state, Wordcode pc, LinkList *restore_p, LinkList *remove_p)
 		 * table so we want to be sure everything is
 		 * properly set up and in permanent memory.
 		 */
-		tpm = (Param) zshcalloc(sizeof *tpm);
+		tpm = (Param) zslabcalloc(sizeof *tpm, MEMTAG_PARAM);
 		tpm->node.nam = ztrdup(pm->node.nam);
 		copyparam(tpm, pm, 0);
 		pm = tpm;
@@ -5274,7 +5286,7 @@ execfuncdef(Estate state, Eprog redir_prog)
 	    *pp = dummy_patprog1;
 	prog->shf = NULL;
 
-	shf = (Shfunc) zalloc(sizeof(*shf));
+	shf = (Shfunc) zslaballoc(sizeof(*shf), MEMTAG_HASHNODE);
 	shf->funcdef = prog;
 	shf->node.flags = tracing_flags;
 	/* No dircache here, not a directory */
@@ -31,6 +31,13 @@
 #include "zsh.mdh"
 #include "hashtable.pro"
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if defined(MAP_SHARED) && defined(PROT_READ)
+#define USE_MMAP 1
+#endif
+#endif
+
 typedef struct scanstatus *ScanStatus;
 typedef struct hashtableimpl* HashTableImpl;
 
@@ -42,11 +49,27 @@ struct hashtableimpl {
     /* HASHTABLE INTERNAL MEMBERS */
     ScanStatus scan;		/* status of a scan over this hashtable     */
 
+    /* OPEN ADDRESSING MEMBERS (see newopenhashtable()) */
+    int open;			/* nodes[] is a linear probing table        */
+    int deleted;		/* number of deleted slots in nodes[]       */
+    unsigned *hashes;		/* cached hash value of each slot in nodes[] */
+
+    /* While a table using open addressing is resized, nodes[] stays    *
+     * complete and in use, and is copied into the new arrays a few     *
+     * slots at a time; changes to slots already copied are mirrored.   */
+    HashNode *grownodes;	/* new nodes[] while resizing, else NULL    */
+    unsigned *growhashes;	/* new hashes[] while resizing              */
+    int growsize;		/* size of grownodes[]                      */
+    int growpos;		/* number of slots of nodes[] copied so far */
+    int growdeleted;		/* number of deleted slots in grownodes[]   */
+
 #ifdef ZSH_HASH_DEBUG
     /* HASHTABLE DEBUG MEMBERS */
     HashTableImpl next, last;	/* linked list of all hash tables           */
     char *tablename;		/* string containing name of the hash table */
     PrintTableStats printinfo;	/* pointer to function to print table stats */
+    int resizes;		/* number of times the table was resized    */
+    double maxpause;		/* longest time spent resizing in one call  */
 #endif /* !ZSH_HASH_DEBUG */
 };
 
@@ -57,7 +80,11 @@ static inline HashTableImpl impl(HashTable ht) { return (HashTableImpl)ht; }
  * of these.  That member being non-NULL disables resizing of the          *
  * hashtable (when adding elements).  When elements are deleted, the       *
  * contents of this structure is used to make sure the scan won't stumble  *
- * into the deleted element.                                               */
+ * into the deleted element.                                               *
+ *                                                                         *
+ * Tables using open addressing are always scanned over a copy of their    *
+ * nodes (the "sorted" case, whether or not the copy is actually sorted),  *
+ * so they may be resized during a scan.                                   */
 
 struct scanstatus {
     int sorted;
@@ -76,9 +103,193 @@ struct scanstatus {
 
 #ifdef ZSH_HASH_DEBUG
 static void printhashtabinfo(HashTable ht);
+static void printcmdmissinfo(void);
 static HashTableImpl firstht, lastht;
+
+/* Record the time spent resizing a table since start */
+
+static void
+hashpause(HashTable ht, struct timespec *start)
+{
+    struct timespec now;
+    double pause;
+
+    zgettime_monotonic_if_available(&now);
+    pause = (double) (now.tv_sec - start->tv_sec) +
+	(double) (now.tv_nsec - start->tv_nsec) / 1e9;
+    if (pause > impl(ht)->maxpause)
+	impl(ht)->maxpause = pause;
+}
 #endif /* ZSH_HASH_DEBUG */
 
+/* Smallest size of the nodes[] array of a table using open addressing; *
+ * the size is always a power of two.                                   */
+
+#define OPEN_MINSIZE 8
+
+/* Open addressing tables are grown (or cleared of deleted slots) *
+ * when more than three quarters of the slots are in use.         */
+
+#define OPEN_FULL(ht, n) ((n) * 4 > (ht)->hsize * 3)
+
+/* Hash value cached for a key; zero marks a slot that was never used */
+
+static inline unsigned
+openhash(HashTable ht, const char *nam)
+{
+    unsigned hashval = ht->hash(nam);
+    return hashval ? hashval : 1;
+}
+
+/* Find the slot holding the node with key nam and hash value hashval *
+ * in a table using open addressing, or return -1.  A slot with no    *
+ * node but a cached hash value was deleted and doesn't end the probe. */
+
+static int
+openfind(HashTable ht, const char *nam, unsigned hashval)
+{
+    HashNode *nodes = ht->nodes;
+    unsigned *hashes = impl(ht)->hashes;
+    unsigned mask = ht->hsize - 1, i = hashval & mask;
+
+    for (; nodes[i] || hashes[i]; i = (i + 1) & mask)
+	if (nodes[i] && hashes[i] == hashval &&
+	    ht->cmpnodes(nodes[i]->nam, nam) == 0)
+	    return i;
+    return -1;
+}
+
+/* Put a node into the first free slot of its probe sequence in the    *
+ * arrays nodes and hashes of the given size.  The caller makes sure   *
+ * its key isn't in the arrays already.                                */
+
+static void
+openplace(HashNode *nodes, unsigned *hashes, int size, int *deleted,
+	  HashNode hn, unsigned hashval)
+{
+    unsigned mask = size - 1, i = hashval & mask;
+
+    while (nodes[i])
+	i = (i + 1) & mask;
+    if (hashes[i])
+	(*deleted)--;
+    nodes[i] = hn;
+    hashes[i] = hashval;
+}
+
+/* Find the slot holding the node hn in the arrays nodes and hashes */
+
+static unsigned
+openslot(HashNode *nodes, unsigned *hashes, int size,
+	 HashNode hn, unsigned hashval)
+{
+    unsigned mask = size - 1, i = hashval & mask;
+
+    while (nodes[i] != hn)
+	i = (i + 1) & mask;
+    return i;
+}
+
+/* Slot i of nodes[] changed from hp to hn (either may be NULL); if *
+ * the slot was copied already, make the same change to grownodes[]. */
+
+static void
+openmirror(HashTable ht, int i, HashNode hp, HashNode hn, unsigned hashval)
+{
+    HashTableImpl hi = impl(ht);
+    unsigned j;
+
+    if (!hi->grownodes || i >= hi->growpos)
+	return;
+    if (!hp) {
+	openplace(hi->grownodes, hi->growhashes, hi->growsize,
+		  &hi->growdeleted, hn, hashval);
+	return;
+    }
+    j = openslot(hi->grownodes, hi->growhashes, hi->growsize, hp, hashval);
+    hi->grownodes[j] = hn;
+    if (!hn)
+	hi->growdeleted++;
+}
+
+/* Abandon resizing a table using open addressing */
+
+static void
+opengrowend(HashTable ht)
+{
+    HashTableImpl hi = impl(ht);
+
+    if (!hi->grownodes)
+	return;
+    zfree(hi->grownodes, hi->growsize * sizeof(HashNode));
+    zfree(hi->growhashes, hi->growsize * sizeof(unsigned));
+    hi->grownodes = NULL;
+    hi->growhashes = NULL;
+}
+
+/* Copy up to n slots of nodes[] to the arrays of a resize in progress. *
+ * When all are copied, the new arrays replace nodes[] and hashes[].    */
+
+static void
+opengrowstep(HashTable ht, int n)
+{
+    HashTableImpl hi = impl(ht);
+
+    for (; n && hi->growpos < ht->hsize; n--, hi->growpos++)
+	if (ht->nodes[hi->growpos])
+	    openplace(hi->grownodes, hi->growhashes, hi->growsize,
+		      &hi->growdeleted, ht->nodes[hi->growpos],
+		      hi->hashes[hi->growpos]);
+    if (hi->growpos < ht->hsize)
+	return;
+
+    zfree(ht->nodes, ht->hsize * sizeof(HashNode));
+    zfree(hi->hashes, ht->hsize * sizeof(unsigned));
+    ht->nodes = hi->grownodes;
+    hi->hashes = hi->growhashes;
+    ht->hsize = hi->growsize;
+    hi->deleted = hi->growdeleted;
+    hi->grownodes = NULL;
+    hi->growhashes = NULL;
+}
+
+/* Number of slots copied per addition to a table being resized.  With *
+ * a quarter of the slots free when resizing starts, this finishes     *
+ * long before nodes[] fills up.                                       */
+
+#define OPEN_GROWSTEP 16
+
+/* Start or continue resizing a table using open addressing.  The new *
+ * size is double the old one, unless removing deleted slots will do. */
+
+static void
+openresize(HashTable ht)
+{
+    HashTableImpl hi = impl(ht);
+#ifdef ZSH_HASH_DEBUG
+    struct timespec start;
+
+    zgettime_monotonic_if_available(&start);
+#endif
+
+    if (!hi->grownodes) {
+	hi->growsize = OPEN_FULL(ht, 2 * ht->ct) ? 2 * ht->hsize : ht->hsize;
+	hi->grownodes = (HashNode *) zshcalloc(hi->growsize * sizeof(HashNode));
+	hi->growhashes = (unsigned *) zshcalloc(hi->growsize * sizeof(unsigned));
+	hi->growpos = hi->growdeleted = 0;
+#ifdef ZSH_HASH_DEBUG
+	hi->resizes++;
+#endif
+    }
+    /* finish at once if nodes[] is about to run out of free slots */
+    opengrowstep(ht, ht->ct + hi->deleted + 2 >= ht->hsize ?
+		 ht->hsize : OPEN_GROWSTEP);
+
+#ifdef ZSH_HASH_DEBUG
+    hashpause(ht, &start);
+#endif
+}
+
 /* Generic hash function */
 
 /**/
@@ -93,6 +304,37 @@ hasher(const char *str)
     return hashval;
 }
 
+/* Hash function reading the key a machine word at a time.  It   *
+ * mixes all bits of the key into the low bits of the result, so *
+ * it is suitable for tables indexed with a power of two mask.   */
+
+#define WORDHASH_MUL	((zulong)0x5bd1e995)
+#define WORDHASH_SHIFT	(sizeof(zulong) * 4 - 1)
+
+/**/
+mod_export unsigned
+wordhasher(const char *str)
+{
+    size_t len = strlen(str);
+    zulong hashval = (zulong)len * WORDHASH_MUL, w;
+
+    for (; len >= sizeof(w); len -= sizeof(w), str += sizeof(w)) {
+	memcpy(&w, str, sizeof(w));
+	hashval = (hashval ^ w) * WORDHASH_MUL;
+	hashval ^= hashval >> WORDHASH_SHIFT;
+    }
+    if (len) {
+	w = 0;
+	memcpy(&w, str, len);
+	hashval = (hashval ^ w) * WORDHASH_MUL;
+    }
+    hashval ^= hashval >> 13;
+    hashval *= WORDHASH_MUL;
+    hashval ^= hashval >> WORDHASH_SHIFT;
+
+    return (unsigned)(hashval ^ (hashval >> (sizeof(zulong) * 4)));
+}
+
 /* Get a new hash table */
 
 /**/
@@ -118,9 +360,34 @@ newhashtable(int size, UNUSED(char const *name), UNUSED(PrintTableStats printinf
     ht->pub.ct = 0;
     ht->scan = NULL;
     ht->pub.scantab = NULL;
+    ht->pub.viewnode = NULL;
     return &ht->pub;
 }
 
+/* Get a new hash table using open addressing.  Rather than a chain *
+ * of nodes, each element of nodes[] holds at most one node, whose  *
+ * next pointer is always NULL, so code walking nodes[] directly    *
+ * works unchanged.  The hash value of each node is cached next to  *
+ * it, so probing rarely has to compare keys and the table can be   *
+ * grown without hashing the keys again.  Callers should set the    *
+ * hash method to wordhasher, since the table is indexed by the low *
+ * bits of the hash value.                                          */
+
+/**/
+mod_export HashTable
+newopenhashtable(int size, char const *name, PrintTableStats printinfo)
+{
+    HashTable ht;
+    int hsize = OPEN_MINSIZE;
+
+    while (hsize < size)
+	hsize <<= 1;
+    ht = newhashtable(hsize, name, printinfo);
+    impl(ht)->open = 1;
+    impl(ht)->hashes = (unsigned *) zshcalloc(hsize * sizeof(unsigned));
+    return ht;
+}
+
 /* Delete a hash table.  After this function has been used, any *
  * existing pointers to the hash table are invalid.             */
 
@@ -140,6 +407,10 @@ deletehashtable(HashTable ht)
 	firstht = impl(ht)->next;
     zsfree(impl(ht)->tablename);
 #endif /* ZSH_HASH_DEBUG */
+    if (impl(ht)->open) {
+	opengrowend(ht);
+	zfree(impl(ht)->hashes, ht->hsize * sizeof(unsigned));
+    }
     zfree(ht->nodes, ht->hsize * sizeof(HashNode));
     zfree(ht, sizeof(struct hashtableimpl));
 }
@@ -173,6 +444,9 @@ addhashnode2(HashTable ht, char *nam, void *nodeptr)
     hn = (HashNode) nodeptr;
     hn->nam = nam;
 
+    if (impl(ht)->open)
+	return openaddnode(ht, hn);
+
     hashval = ht->hash(hn->nam) % ht->hsize;
     hp = ht->nodes[hashval];
 
@@ -221,6 +495,52 @@ addhashnode2(HashTable ht, char *nam, void *nodeptr)
     return NULL;
 }
 
+/* Add a node to a table using open addressing.  A replaced node *
+ * keeps its slot; a new one takes the first deleted slot on its  *
+ * probe sequence, if any.                                        */
+
+/**/
+static HashNode
+openaddnode(HashTable ht, HashNode hn)
+{
+    HashNode *nodes = ht->nodes, hp;
+    unsigned *hashes = impl(ht)->hashes;
+    unsigned hashval = openhash(ht, hn->nam);
+    unsigned mask = ht->hsize - 1, i = hashval & mask;
+    int unused = -1;
+
+    hn->next = NULL;
+    for (; nodes[i] || hashes[i]; i = (i + 1) & mask) {
+	if (!nodes[i]) {
+	    if (unused < 0)
+		unused = i;
+	} else if (hashes[i] == hashval &&
+		   ht->cmpnodes(nodes[i]->nam, hn->nam) == 0) {
+	    hp = nodes[i];
+	    nodes[i] = hn;
+	    openmirror(ht, i, hp, hn, hashval);
+	    if (impl(ht)->scan) {
+		HashNode *hashtab = impl(ht)->scan->u.s.hashtab;
+		int j;
+		for (j = impl(ht)->scan->u.s.ct; j--; )
+		    if (hashtab[j] == hp)
+			hashtab[j] = hn;
+	    }
+	    return hp;
+	}
+    }
+    if (unused >= 0) {
+	i = unused;
+	impl(ht)->deleted--;
+    }
+    nodes[i] = hn;
+    hashes[i] = hashval;
+    openmirror(ht, i, NULL, hn, hashval);
+    if (OPEN_FULL(ht, ++ht->ct + impl(ht)->deleted) || impl(ht)->grownodes)
+	openresize(ht);
+    return NULL;
+}
+
 /* Get an enabled entry in a hash table.  *
  * If successful, it returns a pointer to *
  * the hashnode.  If the node is DISABLED *
@@ -233,6 +553,12 @@ gethashnode(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp;
 
+    if (impl(ht)->open) {
+	int i = openfind(ht, nam, openhash(ht, nam));
+	return (i < 0 || (ht->nodes[i]->flags & DISABLED)) ?
+	    NULL : ht->nodes[i];
+    }
+
     hashval = ht->hash(nam) % ht->hsize;
     for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
 	if (ht->cmpnodes(hp->nam, nam) == 0) {
@@ -257,6 +583,11 @@ gethashnode2(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp;
 
+    if (impl(ht)->open) {
+	int i = openfind(ht, nam, openhash(ht, nam));
+	return i < 0 ? NULL : ht->nodes[i];
+    }
+
     hashval = ht->hash(nam) % ht->hsize;
     for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
 	if (ht->cmpnodes(hp->nam, nam) == 0)
@@ -277,6 +608,9 @@ removehashnode(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp, hq;
 
+    if (impl(ht)->open)
+	return openremovenode(ht, nam);
+
     hashval = ht->hash(nam) % ht->hsize;
     hp = ht->nodes[hashval];
 
@@ -316,6 +650,44 @@ removehashnode(HashTable ht, const char *nam)
     return NULL;
 }
 
+/* Remove a node from a table using open addressing.  The slot keeps *
+ * its cached hash value to mark it as deleted, so that probes for    *
+ * other keys carry on past it, unless it ends a probe sequence       *
+ * anyway: then it and any deleted slots before it become unused.     */
+
+/**/
+static HashNode
+openremovenode(HashTable ht, const char *nam)
+{
+    HashNode *nodes = ht->nodes, hp;
+    unsigned *hashes = impl(ht)->hashes;
+    unsigned mask = ht->hsize - 1;
+    int i = openfind(ht, nam, openhash(ht, nam));
+
+    if (i < 0)
+	return NULL;
+    hp = nodes[i];
+    nodes[i] = NULL;
+    openmirror(ht, i, hp, NULL, hashes[i]);
+    ht->ct--;
+    impl(ht)->deleted++;
+    if (!nodes[(i + 1) & mask] && !hashes[(i + 1) & mask]) {
+	do {
+	    hashes[i] = 0;
+	    impl(ht)->deleted--;
+	    i = (i - 1) & mask;
+	} while (!nodes[i] && hashes[i]);
+    }
+    if (impl(ht)->scan) {
+	HashNode *hashtab = impl(ht)->scan->u.s.hashtab;
+	int j;
+	for (j = impl(ht)->scan->u.s.ct; j--; )
+	    if (hashtab[j] == hp)
+		hashtab[j] = NULL;
+    }
+    return hp;
+}
+
 /* Disable a node in a hash table */
 
 /**/
@@ -345,6 +717,49 @@ hnamcmp(const void *ap, const void *bp)
     return ztrcmp(a->nam, b->nam);
 }
 
+/* Scan a copy of the nodes of a hash table, sorted if requested. *
+ * The array hntab must have room for all nodes.                  */
+
+/**/
+static int
+scancopy(HashTable ht, HashNode *hntab, Patprog pprog, int sorted,
+	 int flags1, int flags2, ScanFunc scanfunc, int scanflags)
+{
+    int i, ct = ht->ct, match = 0;
+    HashNode *htp, hn;
+    struct scanstatus st;
+    struct hashview view;
+
+    /*
+     * Because the structure might change under our feet,
+     * we can't apply the flags and the pattern before sorting,
+     * tempting though that is.
+     */
+    for (htp = hntab, i = 0; i < ht->hsize; i++)
+	for (hn = ht->nodes[i]; hn; hn = hn->next)
+	    *htp++ = hn;
+    if (sorted)
+	qsort((void *)hntab, ct, sizeof(HashNode), hnamcmp);
+
+    st.sorted = 1;
+    st.u.s.hashtab = hntab;
+    st.u.s.ct = ct;
+    impl(ht)->scan = &st;
+
+    for (htp = hntab, i = 0; i < ct; i++, htp++) {
+	if (*htp && (!flags1 || ((*htp)->flags & flags1)) &&
+	    !((*htp)->flags & flags2) &&
+	    (!pprog || pattry(pprog, (*htp)->nam))) {
+	    match++;
+	    scanfunc(ht->viewnode ? ht->viewnode(ht, *htp, &view) : *htp,
+		     scanflags);
+	}
+    }
+
+    impl(ht)->scan = NULL;
+    return match;
+}
+
 /* Scan the nodes in a hash table and execute scanfunc on nodes based on
  * the flags that are set/unset.  scanflags is passed unchanged to
  * scanfunc (if executed).
@@ -364,6 +779,12 @@ hnamcmp(const void *ap, const void *bp)
  * pprog, if non-NULL, is a pattern that must match the name
  * of the node.
  *
+ * If the table has a viewnode method, scanfunc is passed what that
+ * returns for each node rather than the node itself.  The view is
+ * storage local to this scan, so nested scans don't overwrite each
+ * other's, but scanfunc must not keep it after it returns.  The flags
+ * and the pattern are still tested on the node.
+ *
  * The function returns the number of matches, as reduced by pprog, flags1
  * and flags2.
  */
@@ -386,39 +807,22 @@ scanmatchtable(HashTable ht, Patprog pprog, int sorted,
 	ht->scantab(ht, scanfunc, scanflags);
 	return ht->ct;
     }
-    if (sorted) {
-	int i, ct = ht->ct;
-	VARARR(HashNode, hnsorttab, ct);
-	HashNode *htp, hn;
-
-	/*
-	 * Because the structure might change under our feet,
-	 * we can't apply the flags and the pattern before sorting,
-	 * tempting though that is.
-	 */
-	for (htp = hnsorttab, i = 0; i < ht->hsize; i++)
-	    for (hn = ht->nodes[i]; hn; hn = hn->next)
-		*htp++ = hn;
-	qsort((void *)hnsorttab, ct, sizeof(HashNode), hnamcmp);
-
-	st.sorted = 1;
-	st.u.s.hashtab = hnsorttab;
-	st.u.s.ct = ct;
-	impl(ht)->scan = &st;
-
-	for (htp = hnsorttab, i = 0; i < ct; i++, htp++) {
-	    if ((!flags1 || ((*htp)->flags & flags1)) &&
-		!((*htp)->flags & flags2) &&
-		(!pprog || pattry(pprog, (*htp)->nam))) {
-		match++;
-		scanfunc(*htp, scanflags);
-	    }
-	}
-
-	impl(ht)->scan = NULL;
+    if (impl(ht)->open) {
+	int ct = ht->ct;
+	HashNode *hntab = (HashNode *) zalloc(ct * sizeof(HashNode));
+
+	match = scancopy(ht, hntab, pprog, sorted, flags1, flags2,
+			 scanfunc, scanflags);
+	zfree(hntab, ct * sizeof(HashNode));
+    } else if (sorted) {
+	VARARR(HashNode, hnsorttab, ht->ct);
+
+	match = scancopy(ht, hnsorttab, pprog, 1, flags1, flags2,
+			 scanfunc, scanflags);
     } else {
 	int i, hsize = ht->hsize;
 	HashNode *nodes = ht->nodes;
+	struct hashview view;
 
 	st.sorted = 0;
 	impl(ht)->scan = &st;
@@ -430,7 +834,8 @@ scanmatchtable(HashTable ht, Patprog pprog, int sorted,
 		if ((!flags1 || (hn->flags & flags1)) && !(hn->flags & flags2)
 		    && (!pprog || pattry(pprog, hn->nam))) {
 		    match++;
-		    scanfunc(hn, scanflags);
+		    scanfunc(ht->viewnode ? ht->viewnode(ht, hn, &view) : hn,
+			     scanflags);
 		}
 	    }
 
@@ -459,6 +864,12 @@ expandhashtable(HashTable ht)
 {
     struct hashnode **onodes, **ha, *hn, *hp;
     int i, osize;
+#ifdef ZSH_HASH_DEBUG
+    struct timespec start;
+
+    zgettime_monotonic_if_available(&start);
+    impl(ht)->resizes++;
+#endif
 
     osize = ht->hsize;
     onodes = ht->nodes;
@@ -477,6 +888,9 @@ expandhashtable(HashTable ht)
 	}
     }
     zfree(onodes, osize * sizeof(HashNode));
+#ifdef ZSH_HASH_DEBUG
+    hashpause(ht, &start);
+#endif
 }
 
 /* Empty the hash table and resize it if necessary */
@@ -498,6 +912,21 @@ resizehashtable(HashTable ht, int newsize)
 	}
     }
 
+    if (impl(ht)->open) {
+	int hsize = OPEN_MINSIZE;
+
+	opengrowend(ht);
+	while (hsize < newsize)
+	    hsize <<= 1;
+	if (ht->hsize != hsize) {
+	    zfree(impl(ht)->hashes, ht->hsize * sizeof(unsigned));
+	    impl(ht)->hashes = (unsigned *) zalloc(hsize * sizeof(unsigned));
+	}
+	memset(impl(ht)->hashes, 0, hsize * sizeof(unsigned));
+	impl(ht)->deleted = 0;
+	newsize = hsize;
+    }
+
     /* If new size desired is different from current size, *
      * we free it and allocate a new nodes array.          */
     if (ht->hsize != newsize) {
@@ -538,10 +967,40 @@ printhashtabinfo(HashTable ht)
 
     printf("name of table   : %s\n",   impl(ht)->tablename);
     printf("size of nodes[] : %d\n",   ht->hsize);
-    printf("number of nodes : %d\n\n", ht->ct);
+    printf("number of nodes : %d\n",   ht->ct);
+    if (ht == cmdnamtab)
+	printcmdmissinfo();
+    printf("resizes         : %d\n",   impl(ht)->resizes);
+    printf("longest pause   : %.6fs\n", impl(ht)->maxpause);
+    if (impl(ht)->grownodes)
+	printf("resizing to     : %d (%d slots copied)\n",
+	       impl(ht)->growsize, impl(ht)->growpos);
+    putchar('\n');
 
     memset(chainlen, 0, sizeof(chainlen));
 
+    if (impl(ht)->open) {
+	unsigned mask = ht->hsize - 1, dist;
+
+	/* distance of each node from the slot its hash value selects */
+	total = 0;
+	for (i = 0; i < ht->hsize; i++) {
+	    if (!ht->nodes[i])
+		continue;
+	    dist = (i - impl(ht)->hashes[i]) & mask;
+	    chainlen[dist >= MAXDEPTH ? MAXDEPTH : dist]++;
+	    total++;
+	}
+
+	printf("number of deleted slots              : %4d\n",
+	       impl(ht)->deleted);
+	for (i = 0; i < MAXDEPTH; i++)
+	    printf("number of nodes at probe distance %d  : %4d\n", i, chainlen[i]);
+	printf("number of nodes at probe distance %d+ : %4d\n", MAXDEPTH, chainlen[MAXDEPTH]);
+	printf("total number of nodes                : %4d\n", total);
+	return;
+    }
+
     /* count the number of nodes just to be sure */
     total = 0;
     for (i = 0; i < ht->hsize; i++) {
@@ -600,9 +1059,9 @@ mod_export char **pathchecked;
 void
 createcmdnamtable(void)
 {
-    cmdnamtab = newhashtable(201, "cmdnamtab", NULL);
+    cmdnamtab = newopenhashtable(256, "cmdnamtab", NULL);
 
-    cmdnamtab->hash        = hasher;
+    cmdnamtab->hash        = wordhasher;
     cmdnamtab->emptytable  = emptycmdnamtable;
     cmdnamtab->filltable   = fillcmdnamtable;
     cmdnamtab->cmpnodes    = strcmp;
@@ -624,6 +1083,419 @@ emptycmdnamtable(HashTable ht)
 {
     emptyhashtable(ht);
     pathchecked = path;
+    resetcmdmisses();
+}
+
+/*
+ * Cache of names recently searched for in every directory of path
+ * without being found, so that looking for them again costs a single
+ * lookup.  It has a fixed number of slots, a new name replacing the
+ * one in its slot.  Entries are dropped when the command hash table is
+ * emptied (by rehash, or because path changed) and when a directory in
+ * path is seen to have been modified; directories are checked at most
+ * once a second.  Nothing is cached while path contains relative
+ * directories, whose contents depend on the current directory, or
+ * when the HASH_CMDS option is unset.
+ */
+
+#define CMDMISS_SLOTS 128
+
+struct cmdmiss {
+    char *nam;			/* name not found                        */
+    unsigned gen;		/* cmdmissgen when it was added          */
+};
+
+static struct cmdmiss cmdmisses[CMDMISS_SLOTS];
+
+/* entries are valid only if added in the current generation */
+
+static unsigned cmdmissgen = 1;
+
+/* modification times of the directories in path, and when checked */
+
+static time_t *cmdmissmtimes;
+static int cmdmissndirs;
+static time_t cmdmisschecked;
+
+/* counters, shown by hashinfo */
+
+static struct {
+    zlong hits;			/* searches avoided                      */
+    zlong added;		/* names added                           */
+    zlong resets;		/* times all entries were dropped        */
+    zlong dirchecks;		/* times the directories were checked    */
+} cmdmissstats;
+
+#ifdef ZSH_HASH_DEBUG
+static void
+printcmdmissinfo(void)
+{
+    printf("cached misses   : %ld added, %ld hits, %ld resets, "
+	   "%ld directory checks\n",
+	   (long) cmdmissstats.added, (long) cmdmissstats.hits,
+	   (long) cmdmissstats.resets, (long) cmdmissstats.dirchecks);
+}
+#endif /* ZSH_HASH_DEBUG */
+
+/* Drop all cached misses */
+
+/**/
+static void
+resetcmdmisses(void)
+{
+    cmdmissgen++;
+    cmdmissstats.resets++;
+    if (cmdmissmtimes) {
+	zfree(cmdmissmtimes, cmdmissndirs * sizeof(time_t));
+	cmdmissmtimes = NULL;
+    }
+}
+
+/* Make sure the directories in path haven't changed since misses were *
+ * cached, dropping them if they have.  Return 0 if nothing may be     *
+ * cached for the current path.  As for $HASHCACHE, a directory        *
+ * modified within the last second might change again without its     *
+ * mtime doing so: nothing is cached until it has settled.             */
+
+/**/
+static int
+checkcmdmissdirs(void)
+{
+    time_t now = time(NULL), *mtimes;
+    struct stat st;
+    char **pp;
+    int i, n = arrlen(path);
+
+    if (cmdmissmtimes && now == cmdmisschecked)
+	return 1;
+    for (pp = path; *pp; pp++)
+	if (**pp != '/')
+	    return 0;
+    cmdmissstats.dirchecks++;
+    mtimes = (time_t *) zalloc(n * sizeof(time_t));
+    for (i = 0; i < n; i++)
+	mtimes[i] = stat(unmeta(path[i]), &st) ? (time_t) -1 : st.st_mtime;
+    if (cmdmissmtimes && (n != cmdmissndirs ||
+			  memcmp(mtimes, cmdmissmtimes, n * sizeof(time_t))))
+	resetcmdmisses();
+    for (i = 0; i < n; i++)
+	if (mtimes[i] >= now - 1) {
+	    if (cmdmissmtimes)
+		resetcmdmisses();
+	    zfree(mtimes, n * sizeof(time_t));
+	    return 0;
+	}
+    if (cmdmissmtimes)
+	zfree(cmdmissmtimes, cmdmissndirs * sizeof(time_t));
+    cmdmissmtimes = mtimes;
+    cmdmissndirs = n;
+    cmdmisschecked = now;
+    return 1;
+}
+
+/* Return 1 if the command name nam is known not to be in any *
+ * directory of path.                                         */
+
+/**/
+mod_export int
+iscmdmiss(char *nam)
+{
+    struct cmdmiss *m = cmdmisses + (wordhasher(nam) & (CMDMISS_SLOTS - 1));
+
+    if (unset(HASHCMDS) ||
+	!m->nam || m->gen != cmdmissgen || strcmp(m->nam, nam) ||
+	!checkcmdmissdirs() || m->gen != cmdmissgen)
+	return 0;
+    cmdmissstats.hits++;
+    return 1;
+}
+
+/* Note that the command name nam was not found in any directory of path */
+
+/**/
+mod_export void
+addcmdmiss(char *nam)
+{
+    struct cmdmiss *m = cmdmisses + (wordhasher(nam) & (CMDMISS_SLOTS - 1));
+
+    if (unset(HASHCMDS) || strchr(nam, '/') || !checkcmdmissdirs())
+	return;
+    zsfree(m->nam);
+    m->nam = ztrdup(nam);
+    m->gen = cmdmissgen;
+    cmdmissstats.added++;
+}
+
+/*
+ * Cache of the commands found in PATH directories, kept in the file
+ * named by $HASHCACHE so that it is shared between shells.  A directory
+ * whose modification time is unchanged needn't be read again.  The
+ * file is a struct hashcachehdr followed by one record per directory:
+ * a struct hashcacherec, the directory name and the command names,
+ * each metafied and null-terminated, padded to a multiple of
+ * HASHCACHE_ALIGN bytes.  It is only ever replaced by renaming a new
+ * file over it, so a shell that has it mapped never sees it change.
+ */
+
+#define HASHCACHE_MAGIC		0x7a686331
+#define HASHCACHE_MAXDIRS	256
+#define HASHCACHE_ALIGN		sizeof(zlong)
+#define HASHCACHE_PAD(n)	(((n) + HASHCACHE_ALIGN - 1) & \
+				 ~(HASHCACHE_ALIGN - 1))
+
+/* the record was made with HASH_EXECUTABLES_ONLY set */
+#define HASHCACHE_EXECONLY	(1<<0)
+
+struct hashcachehdr {
+    int magic;			/* HASHCACHE_MAGIC */
+    int ndirs;			/* number of records */
+};
+
+struct hashcacherec {
+    zlong mtime;		/* modification time of the directory */
+    long mtimensec;		/* ... and its nanoseconds, if known  */
+    int size;			/* size of the record, with padding   */
+    int flags;			/* HASHCACHE_* flags                  */
+    int dirlen;			/* length of the directory name       */
+    int count;			/* number of command names            */
+};
+
+typedef struct hashcacherec *HashCacheRec;
+
+/* the cache file as read, and what it was read from */
+
+static char *hashcachebuf;
+static size_t hashcachelen;
+static int hashcachemapped;
+static struct stat hashcachest;
+
+/* records for directories read since the file was last written */
+
+static LinkList hashcachenew;
+
+/* Get the name of the cache file, or NULL if there is none */
+
+static char *
+hashcachefile(void)
+{
+#if defined(_WIN32) || defined(__CYGWIN__)
+    /* foo.exe is hashed as foo as well, which the cache doesn't record */
+    return NULL;
+#else
+    char *fn = getsparam("HASHCACHE");
+
+    return (fn && *fn) ? fn : NULL;
+#endif
+}
+
+/**/
+static void
+freehashcache(void)
+{
+    if (!hashcachebuf)
+	return;
+#ifdef USE_MMAP
+    if (hashcachemapped)
+	munmap(hashcachebuf, hashcachelen);
+    else
+#endif
+	zfree(hashcachebuf, hashcachelen);
+    hashcachebuf = NULL;
+}
+
+/* Make sure the current contents of the cache file are available; *
+ * return 0 if there is no usable cache.                           */
+
+/**/
+static int
+readhashcache(char *fn)
+{
+    struct stat st;
+    struct hashcachehdr *hdr;
+    int fd;
+
+    if (stat(unmeta(fn), &st) || !S_ISREG(st.st_mode) ||
+	st.st_size < (off_t)sizeof(struct hashcachehdr)) {
+	freehashcache();
+	return 0;
+    }
+    if (hashcachebuf && st.st_dev == hashcachest.st_dev &&
+	st.st_ino == hashcachest.st_ino &&
+	st.st_size == hashcachest.st_size &&
+	st.st_mtime == hashcachest.st_mtime)
+	return 1;
+
+    freehashcache();
+    if ((fd = open(unmeta(fn), O_RDONLY | O_NOCTTY)) < 0)
+	return 0;
+    hashcachelen = st.st_size;
+#ifdef USE_MMAP
+    hashcachebuf = (char *) mmap(NULL, hashcachelen, PROT_READ,
+				 MAP_SHARED, fd, 0);
+    if (hashcachebuf == (char *) MAP_FAILED)
+	hashcachebuf = NULL;
+    else
+	hashcachemapped = 1;
+#endif
+    if (!hashcachebuf) {
+	hashcachebuf = (char *) zalloc(hashcachelen);
+	hashcachemapped = 0;
+	if (read_loop(fd, hashcachebuf, hashcachelen) !=
+	    (ssize_t)hashcachelen)
+	    freehashcache();
+    }
+    close(fd);
+
+    hdr = (struct hashcachehdr *) hashcachebuf;
+    if (hashcachebuf && hdr->magic != HASHCACHE_MAGIC)
+	freehashcache();
+    if (!hashcachebuf)
+	return 0;
+    hashcachest = st;
+    return 1;
+}
+
+/* Return the next record of the cache file after rec (the first one if *
+ * rec is NULL), or NULL if there are no more or the file is corrupt.   */
+
+static HashCacheRec
+nexthashcacherec(HashCacheRec rec, int *left)
+{
+    size_t off;
+
+    if (rec) {
+	off = (char *) rec - hashcachebuf + rec->size;
+	--*left;
+    } else {
+	off = HASHCACHE_PAD(sizeof(struct hashcachehdr));
+	*left = ((struct hashcachehdr *) hashcachebuf)->ndirs;
+    }
+    if (*left <= 0 || off + sizeof(struct hashcacherec) > hashcachelen)
+	return NULL;
+    rec = (HashCacheRec) (hashcachebuf + off);
+    if (rec->size < (int)sizeof(struct hashcacherec) + rec->dirlen ||
+	rec->size % HASHCACHE_ALIGN || off + rec->size > hashcachelen ||
+	rec->dirlen <= 0 || ((char *) (rec + 1))[rec->dirlen - 1])
+	return NULL;
+    return rec;
+}
+
+/* Add the commands in the directory *dirp, with status st, from the *
+ * cache.  Return 1 if they were, 0 if the directory must be read.   */
+
+/**/
+static int
+hashdirfromcache(char **dirp, char *fn, struct stat *st)
+{
+    HashCacheRec rec;
+    int left, flags = isset(HASHEXECUTABLESONLY) ? HASHCACHE_EXECONLY : 0;
+
+    if (!readhashcache(fn))
+	return 0;
+    for (rec = nexthashcacherec(NULL, &left); rec;
+	 rec = nexthashcacherec(rec, &left)) {
+	char *name = (char *) (rec + 1), *end = (char *) rec + rec->size;
+	int n;
+
+	if (strcmp(name, *dirp) || rec->flags != flags ||
+	    rec->mtime != (zlong) st->st_mtime
+#ifdef GET_ST_MTIME_NSEC
+	    || rec->mtimensec != (long) GET_ST_MTIME_NSEC(*st)
+#endif
+	    )
+	    continue;
+	/* check all names are inside the record before using any */
+	name += rec->dirlen;
+	for (n = rec->count; n; n--, name++)
+	    if (!(name = memchr(name, '\0', end - name)))
+		return 0;
+	name = (char *) (rec + 1) + rec->dirlen;
+	for (n = rec->count; n; n--, name += strlen(name) + 1) {
+	    if (!cmdnamtab->getnode(cmdnamtab, name)) {
+		Cmdnam cn = (Cmdnam) zslabcalloc(sizeof *cn, MEMTAG_HASHNODE);
+		cn->node.flags = 0;
+		cn->u.name = dirp;
+		cmdnamtab->addnode(cmdnamtab, ztrdup(name), cn);
+	    }
+	}
+	return 1;
+    }
+    return 0;
+}
+
+/* Find the node of hashcachenew with the record for directory dir */
+
+/**/
+static LinkNode
+newhashcacherec(char *dir)
+{
+    LinkNode ln;
+
+    for (ln = firstnode(hashcachenew); ln; incnode(ln))
+	if (!strcmp((char *) ((HashCacheRec) getdata(ln) + 1), dir))
+	    return ln;
+    return NULL;
+}
+
+/* Write the cache file if directories were read since it was last *
+ * written.  Records from the old file for directories not read    *
+ * again are kept, up to a limit.                                  */
+
+/**/
+mod_export void
+savehashcache(void)
+{
+    char *fn = hashcachefile(), *tmp;
+    struct hashcachehdr hdr;
+    HashCacheRec rec;
+    LinkNode ln;
+    FILE *out = NULL;
+    int left, fd, ok = 1;
+
+    if (!hashcachenew || empty(hashcachenew))
+	return;
+    if (fn) {
+	readhashcache(fn);
+	fn = ztrdup(unmeta(fn));
+	tmp = (char *) zalloc(strlen(fn) + DIGBUFSIZE + 1);
+	sprintf(tmp, "%s.%ld", fn, (long) getpid());
+	unlink(tmp);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOCTTY,
+		       0600)) >= 0 && !(out = fdopen(fd, "w")))
+	    close(fd);
+    }
+    if (out) {
+	hdr.magic = HASHCACHE_MAGIC;
+	hdr.ndirs = 0;
+	ok &= fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+	for (ln = firstnode(hashcachenew); ln; incnode(ln)) {
+	    rec = (HashCacheRec) getdata(ln);
+	    ok &= fwrite(rec, rec->size, 1, out) == 1;
+	    hdr.ndirs++;
+	}
+	if (hashcachebuf) {
+	    for (rec = nexthashcacherec(NULL, &left);
+		 rec && hdr.ndirs < HASHCACHE_MAXDIRS;
+		 rec = nexthashcacherec(rec, &left)) {
+		if (newhashcacherec((char *) (rec + 1)))
+		    continue;
+		ok &= fwrite(rec, rec->size, 1, out) == 1;
+		hdr.ndirs++;
+	    }
+	}
+	ok &= !fseek(out, 0, SEEK_SET) &&
+	    fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+	ok &= !fclose(out);
+	if (!ok || rename(tmp, fn))
+	    unlink(tmp);
+    }
+    if (fn) {
+	zfree(tmp, strlen(fn) + DIGBUFSIZE + 1);
+	zsfree(fn);
+    }
+    while ((rec = (HashCacheRec) getlinknode(hashcachenew)))
+	zfree(rec, rec->size);
+    freehashcache();
 }
 
 /* Add all commands in a given directory *
@@ -635,8 +1507,12 @@ hashdir(char **dirp)
 {
     Cmdnam cn;
     DIR *dir;
-    char *fn, *unmetadir, *pathbuf, *pathptr;
+    char *fn, *unmetadir, *pathbuf, *pathptr, *cachefile;
     int dirlen;
+    HashCacheRec rec = NULL;
+    size_t recsize = 0;
+    struct stat dirst;
+    LinkNode ln;
 #if defined(_WIN32) || defined(__CYGWIN__)
     char *exe;
 #endif /* _WIN32 || _CYGWIN__ */
@@ -644,8 +1520,35 @@ hashdir(char **dirp)
     if (isrelative(*dirp))
 	return;
     unmetadir = unmeta(*dirp);
-    if (!(dir = opendir(unmetadir)))
+    if ((cachefile = hashcachefile()) && !stat(unmetadir, &dirst)) {
+	if (hashdirfromcache(dirp, cachefile, &dirst))
+	    return;
+	/*
+	 * A directory changed within the last second may change again
+	 * without its time stamp changing, so don't record it.
+	 */
+	if (dirst.st_mtime < time(NULL) - 1) {
+	    recsize = sizeof(*rec) + strlen(*dirp) + 1 + 256;
+	    rec = (HashCacheRec) zalloc(recsize);
+	    rec->mtime = (zlong) dirst.st_mtime;
+#ifdef GET_ST_MTIME_NSEC
+	    rec->mtimensec = (long) GET_ST_MTIME_NSEC(dirst);
+#else
+	    rec->mtimensec = 0;
+#endif
+	    rec->flags = isset(HASHEXECUTABLESONLY) ? HASHCACHE_EXECONLY : 0;
+	    rec->dirlen = strlen(*dirp) + 1;
+	    rec->count = 0;
+	    strcpy((char *) (rec + 1), *dirp);
+	    rec->size = sizeof(*rec) + rec->dirlen;
+	}
+	unmetadir = unmeta(*dirp);
+    }
+    if (!(dir = opendir(unmetadir))) {
+	if (rec)
+	    zfree(rec, recsize);
 	return;
+    }
 
     dirlen = strlen(unmetadir);
     pathbuf = (char *)zalloc(dirlen + PATH_MAX + 2);
@@ -653,7 +1556,10 @@ hashdir(char **dirp)
     pathptr = pathbuf + dirlen + 1;
 
     while ((fn = zreaddir(dir, 1))) {
-	if (!cmdnamtab->getnode(cmdnamtab, fn)) {
+	int known = cmdnamtab->getnode(cmdnamtab, fn) != NULL;
+
+	/* when recording the directory, check names hashed already, too */
+	if (!known || rec) {
 	    char *fname = ztrdup(fn);
 	    struct stat statbuf;
 	    int add = 0, dummylen;
@@ -674,8 +1580,20 @@ hashdir(char **dirp)
 		     S_ISREG(statbuf.st_mode) && (statbuf.st_mode & S_IXUGO)))
 		    add = 1;
 	    }
-	    if (add) {
-		cn = (Cmdnam) zshcalloc(sizeof *cn);
+	    if (add && rec) {
+		int len = strlen(fname) + 1;
+
+		if (rec->size + len > (int)recsize) {
+		    size_t newsize = 2 * (recsize + len);
+		    rec = (HashCacheRec) zrealloc(rec, newsize);
+		    recsize = newsize;
+		}
+		strcpy((char *) rec + rec->size, fname);
+		rec->size += len;
+		rec->count++;
+	    }
+	    if (add && !known) {
+		cn = (Cmdnam) zslabcalloc(sizeof *cn, MEMTAG_HASHNODE);
 		cn->node.flags = 0;
 		cn->u.name = dirp;
 		cmdnamtab->addnode(cmdnamtab, fname, cn);
@@ -692,7 +1610,7 @@ hashdir(char **dirp)
 	    (exe[3] == 'E' || exe[3] == 'e') && exe[4] == 0) {
 	    *exe = 0;
 	    if (!cmdnamtab->getnode(cmdnamtab, fn)) {
-		cn = (Cmdnam) zshcalloc(sizeof *cn);
+		cn = (Cmdnam) zslabcalloc(sizeof *cn, MEMTAG_HASHNODE);
 		cn->node.flags = 0;
 		cn->u.name = dirp;
 		cmdnamtab->addnode(cmdnamtab, ztrdup(fn), cn);
@@ -702,6 +1620,22 @@ hashdir(char **dirp)
     }
     closedir(dir);
     zfree(pathbuf, dirlen + PATH_MAX + 2);
+
+    if (rec) {
+	/* pad and shrink the record to its final size */
+	int size = HASHCACHE_PAD(rec->size);
+
+	rec = (HashCacheRec) zrealloc(rec, size);
+	memset((char *) rec + rec->size, 0, size - rec->size);
+	rec->size = size;
+	if (!hashcachenew)
+	    hashcachenew = znewlinklist();
+	else if ((ln = newhashcacherec(*dirp))) {
+	    HashCacheRec old = (HashCacheRec) remnode(hashcachenew, ln);
+	    zfree(old, old->size);
+	}
+	zaddlinknode(hashcachenew, rec);
+    }
 }
 
 /* Go through user's PATH and add everything to *
@@ -717,6 +1651,7 @@ fillcmdnamtable(UNUSED(HashTable ht))
 	hashdir(pq);
 
     pathchecked = pq;
+    savehashcache();
 }
 
 /**/
@@ -811,9 +1746,9 @@ mod_export HashTable shfunctab;
 void
 createshfunctable(void)
 {
-    shfunctab = newhashtable(7, "shfunctab", NULL);
+    shfunctab = newopenhashtable(8, "shfunctab", NULL);
 
-    shfunctab->hash        = hasher;
+    shfunctab->hash        = wordhasher;
     shfunctab->emptytable  = NULL;
     shfunctab->filltable   = NULL;
     shfunctab->cmpnodes    = strcmp;
@@ -1231,7 +2166,7 @@ createaliasnode(char *txt, int flags)
 {
     Alias al;
 
-    al = (Alias) zshcalloc(sizeof *al);
+    al = (Alias) zslabcalloc(sizeof *al, MEMTAG_HASHNODE);
     al->node.flags = flags;
     al->text = txt;
     al->inuse = 0;
@@ -1420,15 +2355,19 @@ addhistnode(HashTable ht, char *nam, void *nodeptr)
 {
     HashNode oldnode = addhashnode2(ht, nam, nodeptr);
     Histent he = (Histent)nodeptr;
+
+    histindexadd(he);
     if (oldnode && oldnode != (HashNode)nodeptr) {
 	if (he->node.flags & HIST_MAKEUNIQUE
 	 || (he->node.flags & HIST_FOREIGN && (Histent)oldnode == he->up)) {
 	    (void) addhashnode2(ht, oldnode->nam, oldnode); /* restore hash */
 	    he->node.flags |= HIST_DUP;
 	    he->node.flags &= ~HIST_MAKEUNIQUE;
+	    addhistdup(he);
 	}
 	else {
 	    oldnode->flags |= HIST_DUP;
+	    addhistdup((Histent)oldnode);
 	    if (hist_ignore_all_dups)
 		freehistnode(oldnode); /* Remove the old dup */
 	}
@@ -1455,12 +2394,14 @@ freehistdata(Histent he, int unlink)
     if (he == &curline)
 	return;
 
-    if (!(he->node.flags & (HIST_DUP | HIST_TMPSTORE)))
+    histindexdel(he);
+    if (he->node.flags & HIST_DUP)
+	delhistdup(he);
+    else if (!(he->node.flags & HIST_TMPSTORE))
 	removehashnode(histtab, he->node.nam);
 
-    zsfree(he->node.nam);
-    if (he->nwords)
-	zfree(he->words, he->nwords*2*sizeof(short));
+    freehisttext(he);
+    dircache_set(&he->dir, NULL);
 
     if (unlink) {
 	if (!--histlinect)
@@ -30,6 +30,19 @@
 #include "zsh.mdh"
 #include "hist.pro"
 
+#include <math.h>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if defined(MAP_SHARED) && defined(PROT_READ)
+#define USE_MMAP 1
+#endif
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 /* Functions to call for getting/ungetting a character and for history
  * word control. */
 
@@ -211,19 +224,126 @@ static zlong defev;
  */
 static int hist_keep_comment;
 
-/* Remember the last line in the history file so we can find it again. */
+/* Number of stretches of the history file we remember writing. */
+#define HIST_OWN_MAX 8
+
+/*
+ * Remember the last line in the history file so we can find it again.
+ * fend is the offset just past that line, i.e. how far we have got
+ * in the file identified by dev and ino; it is zero if we don't know.
+ * With HIST_ATOMIC_APPEND other shells may have added lines before
+ * ours that we haven't read yet, so we remember where ours went
+ * (ownbeg and ownend) in order not to read them back in.
+ */
 static struct histfile_stats {
     char *text;
     time_t stim, mtim;
-    off_t fpos, fsiz;
+    off_t fpos, fsiz, fend;
+    off_t ownbeg[HIST_OWN_MAX], ownend[HIST_OWN_MAX];
+    int nown;
+    dev_t dev;
+    ino_t ino;
     int interrupted;
     zlong next_write_ev;
 } lasthist;
 
+/*
+ * The entries marked HIST_DUP, kept as a heap ordered by history
+ * number so that the oldest one is always at the top; each entry
+ * records its own position in dupidx.
+ */
+static Histent *histdups;
+static int histdupct, histdupsiz;
+
+/*
+ * Index of the text of the history by trigram, so that searches can
+ * go straight to the lines that might contain a string rather than
+ * looking at every one.  It is only built when a search first asks
+ * for it, then kept up to date as lines come and go.
+ *
+ * Each trigram, folded to lower case, has a list of the numbers of
+ * the lines containing it, in increasing order.  Lines with characters
+ * outside ASCII, which may match case-insensitively in ways the index
+ * can't tell, are listed under other instead and always looked at.
+ * Lines are also listed by the directory they were entered in, keyed
+ * by a hash of its name, and by the exit status of the command, with
+ * a further list of all those that failed.  Numbers are only ever
+ * added at the end of a list, so a line that goes leaves its numbers
+ * behind; they are skipped when they turn up, and once there are too
+ * many of them the index is thrown away and built afresh next time.
+ * ents finds the entry for a number.
+ */
+
+struct histlist {
+    int key;			/* what's listed, -1 if the slot is free */
+    int len, size;
+    zlong *nums;
+};
+
+/* Open hash table of lists */
+
+struct histlisttab {
+    struct histlist *lists;
+    int size, used;
+};
+
+struct histindex {
+    struct histlisttab trigrams;	/* by trigram */
+    struct histlist other;		/* lines that aren't plain ASCII */
+    struct histlisttab dirs;		/* by directory */
+    struct histlisttab stats;		/* by exit status */
+    struct histlist failed;		/* non-zero exit status */
+    Histent *ents;		/* ents[n - base] is line n, if still there */
+    zlong base;
+    int entsize;
+    zlong nposts, nstale;	/* numbers in lists, those that are stale */
+};
+
+static struct histindex *histidx;
+
+/* The line whose exit status sethiststatus() will record, if not 0 */
+
+static zlong histstatusnum;
+
+/*
+ * The text and word positions of history lines are kept in large
+ * chunks of memory instead of being allocated line by line.  Space
+ * is taken from the end of the newest chunk.  When a line goes its
+ * space is only counted as free, and a chunk is given back once
+ * nothing in it is used any more; usually that happens as the oldest
+ * lines expire.  If lines from the middle of the history went (e.g.
+ * duplicates) and most of the arena is unused, the remaining lines
+ * are copied to a fresh arena before the next line is added.  Each
+ * history on the stack used by fc -p has its own arena.
+ */
+
+#define HISTCHUNK_SIZE	65536
+
+struct histchunk {
+    char *mem;
+    size_t size;		/* bytes allocated */
+    size_t used;		/* bytes handed out */
+    size_t live;		/* bytes handed out and not freed */
+};
+
+struct histarena {
+    struct histchunk *chunks;	/* in order of address */
+    int nchunks, chunksiz;
+    int cur;			/* chunk new space comes from, or -1 */
+    size_t size, used, live;	/* totals for all chunks */
+};
+
+static struct histarena histarena = { NULL, 0, 0, -1, 0, 0, 0 };
+
 static struct histsave {
     struct histfile_stats lasthist;
     char *histfile;
     HashTable histtab;
+    Histent *histdups;
+    int histdupct, histdupsiz;
+    struct histindex *histidx;
+    struct histarena histarena;
+    zlong histstatusnum;
     Histent hist_ring;
     zlong curhist;
     zlong histlinect;
@@ -543,6 +663,7 @@ getsubsargs(UNUSED(char *subline), int *gbalp, int *cflagp)
 static int
 getargc(Histent ehist)
 {
+    gethistwords(ehist);
     return ehist->nwords ? ehist->nwords-1 : 0;
 }
 
@@ -1239,12 +1360,660 @@ histreduceblanks(void)
 void
 histremovedups(void)
 {
-    Histent he, next;
-    for (he = hist_ring; he; he = next) {
-	next = up_histent(he);
+    while (histdupct)
+	freehistnode(&histdups[0]->node);
+}
+
+/**/
+static void
+sethistdup(int i, Histent he)
+{
+    histdups[i] = he;
+    he->dupidx = i;
+}
+
+/**/
+static void
+histdupup(int i)
+{
+    Histent he = histdups[i];
+
+    while (i > 0) {
+	int parent = (i - 1) / 2;
+	if (histdups[parent]->histnum <= he->histnum)
+	    break;
+	sethistdup(i, histdups[parent]);
+	i = parent;
+    }
+    sethistdup(i, he);
+}
+
+/**/
+static void
+histdupdown(int i)
+{
+    Histent he = histdups[i];
+
+    for (;;) {
+	int child = 2 * i + 1;
+	if (child >= histdupct)
+	    break;
+	if (child + 1 < histdupct &&
+	    histdups[child + 1]->histnum < histdups[child]->histnum)
+	    child++;
+	if (he->histnum <= histdups[child]->histnum)
+	    break;
+	sethistdup(i, histdups[child]);
+	i = child;
+    }
+    sethistdup(i, he);
+}
+
+/* Remember that he has just been marked HIST_DUP. */
+
+/**/
+void
+addhistdup(Histent he)
+{
+    if (histdupct == histdupsiz) {
+	histdupsiz = histdupsiz ? 2 * histdupsiz : 32;
+	histdups = zrealloc(histdups, histdupsiz * sizeof(Histent));
+    }
+    histdups[histdupct] = he;
+    histdupup(histdupct++);
+}
+
+/* Forget he, which is marked HIST_DUP, as it is about to go. */
+
+/**/
+void
+delhistdup(Histent he)
+{
+    int i = he->dupidx;
+
+    DPUTS(i >= histdupct || histdups[i] != he,
+	  "BUG: duplicate history entry not found");
+    if (i != --histdupct) {
+	Histent last = histdups[histdupct];
+
+	sethistdup(i, last);
+	histdupup(i);
+	if (last->dupidx == i)
+	    histdupdown(i);
+    }
+}
+
+static void
+freehistlist(struct histlist *l)
+{
+    if (l->nums)
+	zfree(l->nums, l->size * sizeof(zlong));
+}
+
+static void
+freehistlisttab(struct histlisttab *ltab)
+{
+    int i;
+
+    for (i = 0; i < ltab->size; i++)
+	freehistlist(ltab->lists + i);
+    if (ltab->lists)
+	zfree(ltab->lists, ltab->size * sizeof(struct histlist));
+}
+
+/* Throw away the index of the history text, if any. */
+
+/**/
+void
+freehistindex(void)
+{
+    struct histindex *idx = histidx;
+
+    if (!idx)
+	return;
+    freehistlisttab(&idx->trigrams);
+    freehistlist(&idx->other);
+    freehistlisttab(&idx->dirs);
+    freehistlisttab(&idx->stats);
+    freehistlist(&idx->failed);
+    if (idx->ents)
+	zfree(idx->ents, idx->entsize * sizeof(Histent));
+    zfree(idx, sizeof(struct histindex));
+    histidx = NULL;
+}
+
+/*
+ * The trigram at s, folded to lower case, or -1 if there aren't
+ * three plain ASCII characters there.
+ */
+
+/**/
+static int
+histtrikey(char *s)
+{
+    int i, key = 0;
+
+    for (i = 0; i < 3; i++) {
+	int c = (unsigned char)s[i];
+	if (!c || c >= 0x80)
+	    return -1;
+	if (c >= 'A' && c <= 'Z')
+	    c += 'a' - 'A';
+	key = (key << 8) | c;
+    }
+    return key;
+}
+
+/* The key for the list of lines entered in directory dir. */
+
+/**/
+static int
+histdirkey(char *dir)
+{
+    return (int)(hasher(dir) & 0x7fffffff);
+}
+
+static struct histlist *
+findhistlist(struct histlisttab *ltab, int key, int add)
+{
+    struct histlist *l;
+    unsigned i;
+
+    if (key < 0)
+	return NULL;
+    if (add && 2 * (ltab->used + 1) > ltab->size) {
+	struct histlist *olists = ltab->lists;
+	int osize = ltab->size;
+
+	ltab->size = osize ? 2 * osize : 1024;
+	ltab->lists = zalloc(ltab->size * sizeof(struct histlist));
+	for (i = 0; i < (unsigned)ltab->size; i++) {
+	    ltab->lists[i].key = -1;
+	    ltab->lists[i].nums = NULL;
+	}
+	for (i = 0; i < (unsigned)osize; i++) {
+	    if (olists[i].key >= 0) {
+		unsigned j = (olists[i].key * 2654435761U) &
+		    (ltab->size - 1);
+		while (ltab->lists[j].key >= 0)
+		    j = (j + 1) & (ltab->size - 1);
+		ltab->lists[j] = olists[i];
+	    }
+	}
+	if (olists)
+	    zfree(olists, osize * sizeof(struct histlist));
+    }
+    if (!ltab->size)
+	return NULL;
+    for (i = (key * 2654435761U) & (ltab->size - 1);
+	 (l = ltab->lists + i)->key >= 0;
+	 i = (i + 1) & (ltab->size - 1))
+	if (l->key == key)
+	    return l;
+    if (!add)
+	return NULL;
+    l->key = key;
+    l->len = l->size = 0;
+    ltab->used++;
+    return l;
+}
+
+static void
+addhistlist(struct histindex *idx, struct histlist *l, zlong num)
+{
+    int i = l->len;
+
+    /* The line is already there if it came up before. */
+    if (i && l->nums[i - 1] == num)
+	return;
+    if (l->len == l->size) {
+	int osize = l->size;
+
+	l->size = osize ? 2 * osize : 4;
+	l->nums = zrealloc(l->nums, l->size * sizeof(zlong));
+    }
+    /*
+     * Numbers come in order, except that an exit status could in
+     * principle turn up after a later line; keep the list sorted.
+     */
+    while (i && l->nums[i - 1] > num)
+	i--;
+    if (i && l->nums[i - 1] == num)
+	return;
+    if (i < l->len)
+	memmove(l->nums + i + 1, l->nums + i,
+		(l->len - i) * sizeof(zlong));
+    l->nums[i] = num;
+    l->len++;
+    idx->nposts++;
+}
+
+/* List he under its exit status, if that's known. */
+
+static void
+histindexstat(struct histindex *idx, Histent he)
+{
+    if (!(he->node.flags & HIST_STATUS) || he->status < 0)
+	return;
+    addhistlist(idx, findhistlist(&idx->stats, he->status, 1),
+		he->histnum);
+    if (he->status)
+	addhistlist(idx, &idx->failed, he->histnum);
+}
+
+/*
+ * Index the text of he, which has just gone into the history.
+ */
+
+/**/
+void
+histindexadd(Histent he)
+{
+    struct histindex *idx = histidx;
+    zlong num = he->histnum;
+    char *s;
+
+    if (!idx || he == &curline)
+	return;
+    if (!idx->entsize)
+	idx->base = num;
+    if (num < idx->base) {
+	/* Shouldn't happen, but easy to recover from. */
+	freehistindex();
+	return;
+    }
+    if (num - idx->base >= idx->entsize) {
+	int skip = 0, need;
+
+	/* Lose the slots for lines that have gone from the start. */
+	while (skip < idx->entsize && !idx->ents[skip])
+	    skip++;
+	if (skip && 2 * skip >= idx->entsize) {
+	    memmove(idx->ents, idx->ents + skip,
+		    (idx->entsize - skip) * sizeof(Histent));
+	    memset(idx->ents + idx->entsize - skip, 0,
+		   skip * sizeof(Histent));
+	    idx->base += skip;
+	}
+	if ((need = num - idx->base + 1) > idx->entsize) {
+	    int osize = idx->entsize;
+
+	    idx->entsize = osize ? 2 * osize : 1024;
+	    if (idx->entsize < need)
+		idx->entsize = need;
+	    idx->ents = zrealloc(idx->ents, idx->entsize * sizeof(Histent));
+	    memset(idx->ents + osize, 0,
+		   (idx->entsize - osize) * sizeof(Histent));
+	}
+    }
+    idx->ents[num - idx->base] = he;
+
+    if (he->dir)
+	addhistlist(idx, findhistlist(&idx->dirs, histdirkey(he->dir), 1),
+		    num);
+    histindexstat(idx, he);
+    for (s = he->node.nam; *s; s++) {
+	if ((unsigned char)*s >= 0x80) {
+	    addhistlist(idx, &idx->other, num);
+	    return;
+	}
+    }
+    for (s = he->node.nam; s[0] && s[1] && s[2]; s++)
+	addhistlist(idx, findhistlist(&idx->trigrams, histtrikey(s), 1),
+		    num);
+}
+
+/*
+ * he is about to leave the history: forget it.
+ */
+
+/**/
+void
+histindexdel(Histent he)
+{
+    struct histindex *idx = histidx;
+    zlong num = he->histnum;
+    size_t len;
+
+    if (!idx || he == &curline)
+	return;
+    if (num >= idx->base && num - idx->base < idx->entsize &&
+	idx->ents[num - idx->base] == he)
+	idx->ents[num - idx->base] = NULL;
+    /* Roughly how many numbers in lists now refer to nothing. */
+    len = he->node.nam ? strlen(he->node.nam) : 0;
+    idx->nstale += len > 2 ? len - 2 : 1;
+    if (he->dir)
+	idx->nstale++;
+    if (he->node.flags & HIST_STATUS)
+	idx->nstale += he->status ? 2 : 1;
+    if (idx->nstale > 4096 && 2 * idx->nstale > idx->nposts)
+	freehistindex();
+}
+
+/* Find the entry for line num, using the index if it's there. */
+
+/**/
+mod_export Histent
+histindexent(zlong num)
+{
+    struct histindex *idx = histidx;
+    Histent he;
+
+    if (!idx || !hist_ring)
+	return quietgethist(num);
+    if (num == hist_ring->histnum)
+	he = hist_ring;
+    else if (num < idx->base || num - idx->base >= idx->entsize ||
+	     !(he = idx->ents[num - idx->base]) || he->histnum != num)
+	return NULL;
+    checkcurline(he);
+    return he;
+}
+
+/*
+ * The index, built now if it wasn't already.  NULL if it couldn't
+ * be built, in which case the caller has to look at every line.
+ */
+
+static struct histindex *
+gethistindex(void)
+{
+    Histent ent;
+
+    if (histidx)
+	return histidx;
+    histidx = zshcalloc(sizeof(struct histindex));
+    if (hist_ring)
+	for (ent = hist_ring->down; ; ent = ent->down) {
+	    histindexadd(ent);
+	    if (ent == hist_ring || !histidx)
+		break;
+	}
+    return histidx;
+}
+
+/*
+ * Return 1 if histindexfind() can look for str, i.e. if it has
+ * at least three characters or any that aren't plain ASCII.
+ */
+
+/**/
+mod_export int
+histindexable(char *str)
+{
+    char *s;
+
+    for (s = str; *s; s++)
+	if ((unsigned char)*s >= 0x80)
+	    return 1;
+    return s - str >= 3;
+}
+
+/*
+ * In a sorted list of n numbers, the index of the first greater
+ * than num (dir > 0) or of the last less than num (dir < 0), which
+ * may be off either end.
+ */
+
+/**/
+static int
+histtrinext(zlong *nums, int n, zlong num, int dir)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (nums[mid] > num || (dir < 0 && nums[mid] == num))
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return dir > 0 ? lo : lo - 1;
+}
+
+/*
+ * Starting from he, find the next entry in direction dir that isn't
+ * marked with any of xflags and might contain str, which is
+ * metafied and must pass histindexable(); whether it really does
+ * is up to the caller.  Case is ignored, as the search widgets can
+ * match lower case in str against upper case in the line.  Lines
+ * edited in ZLE aren't covered as the index only knows the original
+ * text.  Return NULL if there's nothing more.
+ */
+
+/**/
+mod_export Histent
+histindexfind(Histent he, int dir, char *str, int xflags)
+{
+    struct histindex *idx;
+    struct histlist *best = NULL;
+    zlong num = he->histnum;
+    char *s;
+    int ascii = 1;
+
+    if (!(idx = gethistindex()))
+	return movehistent(he, dir, xflags);
+    for (s = str; *s; s++)
+	if ((unsigned char)*s >= 0x80)
+	    ascii = 0;
+    if (ascii) {
+	/* The trigram with the fewest lines will do. */
+	for (s = str; s[0] && s[1] && s[2]; s++) {
+	    struct histlist *tri =
+		findhistlist(&idx->trigrams, histtrikey(s), 0);
+	    if (!tri) {
+		best = NULL;
+		break;
+	    }
+	    if (!best || tri->len < best->len)
+		best = tri;
+	}
+    }
+    for (;;) {
+	zlong next = -1;
+	int i;
+
+	if (best) {
+	    i = histtrinext(best->nums, best->len, num, dir);
+	    if (i >= 0 && i < best->len)
+		next = best->nums[i];
+	}
+	i = histtrinext(idx->other.nums, idx->other.len, num, dir);
+	if (i >= 0 && i < idx->other.len &&
+	    (next < 0 || (dir > 0) == (idx->other.nums[i] < next)))
+	    next = idx->other.nums[i];
+	if (next < 0)
+	    break;
+	if ((he = histindexent(next)) && !(he->node.flags & xflags))
+	    return he;
+	num = next;
+    }
+    /* The line being edited isn't in the index. */
+    if (dir > 0 && hist_ring && hist_ring->histnum > num &&
+	(hist_ring->histnum < idx->base ||
+	 hist_ring->histnum - idx->base >= idx->entsize ||
+	 !idx->ents[hist_ring->histnum - idx->base]) &&
+	!(hist_ring->node.flags & xflags)) {
+	checkcurline(hist_ring);
+	return hist_ring;
+    }
+    return NULL;
+}
+
+/*
+ * Return 1 if he was entered in directory dir, if that's not NULL,
+ * and its exit status matches status, which may be HISTSTAT_ANY
+ * or HISTSTAT_FAILED for any non-zero status.
+ */
+
+/**/
+int
+histfiltermatch(Histent he, char *dir, int status)
+{
+    if (dir && (!he->dir || strcmp(he->dir, dir)))
+	return 0;
+    if (status == HISTSTAT_ANY)
+	return 1;
+    if (!(he->node.flags & HIST_STATUS))
+	return 0;
+    return status == HISTSTAT_FAILED ? he->status != 0 :
+	he->status == status;
+}
+
+/*
+ * Starting from he, find the next entry in direction dir that isn't
+ * marked with any of xflags, was entered in directory cwd, if that's
+ * not NULL, and finished with the given status, as for
+ * histfiltermatch().  Only the lines that qualify are looked at.
+ * Return NULL if there's nothing more.
+ */
+
+/**/
+mod_export Histent
+histindexfilter(Histent he, int dir, char *cwd, int status, int xflags)
+{
+    struct histindex *idx;
+    struct histlist *l = NULL, *sl = NULL;
+    zlong num = he->histnum;
+    int i;
+
+    if (!(idx = gethistindex())) {
+	while ((he = movehistent(he, dir, xflags)) &&
+	       !histfiltermatch(he, cwd, status))
+	    ;
+	return he;
+    }
+    if (cwd && !(l = findhistlist(&idx->dirs, histdirkey(cwd), 0)))
+	return NULL;
+    if (status == HISTSTAT_FAILED)
+	sl = &idx->failed;
+    else if (status != HISTSTAT_ANY &&
+	     !(sl = findhistlist(&idx->stats, status, 0)))
+	return NULL;
+    if (!l || (sl && sl->len < l->len))
+	l = sl;
+    if (!l)
+	return movehistent(he, dir, xflags);
+    for (i = histtrinext(l->nums, l->len, num, dir);
+	 i >= 0 && i < l->len; i += dir > 0 ? 1 : -1) {
+	if ((he = histindexent(l->nums[i])) &&
+	    !(he->node.flags & xflags) && histfiltermatch(he, cwd, status))
+	    return he;
+    }
+    return NULL;
+}
+
+/*
+ * Record the exit status of the line that was last executed from
+ * the top level, and index it if the line is still there.
+ */
+
+/**/
+void
+sethiststatus(int status)
+{
+    Histent he;
+
+    if (!histstatusnum)
+	return;
+    if ((he = quietgethist(histstatusnum)) && he != &curline) {
+	he->status = status;
+	he->node.flags |= HIST_STATUS;
+	if (histidx && histidx->entsize && histstatusnum >= histidx->base &&
+	    histstatusnum - histidx->base < histidx->entsize &&
+	    histidx->ents[histstatusnum - histidx->base] == he)
+	    histindexstat(histidx, he);
+    }
+    histstatusnum = 0;
+}
+
+/*
+ * Ranking of the distinct lines of the history for fuzzy searching.
+ * Every occurrence of a line counts towards its score, but for half
+ * as much for each HISTRANK_HALFLIFE events it is older than the
+ * newest line, so lines used often and lately come first.
+ */
+
+#define HISTRANK_HALFLIFE 500.0
+
+struct histrank {
+    Histent key;		/* entry in histtab for the text */
+    Histent he;			/* most recent entry with the text */
+    double score;
+};
+
+static int
+histrankkeycmp(const void *a, const void *b)
+{
+    const struct histrank *ra = a, *rb = b;
+
+    if (ra->key == rb->key)
+	return 0;
+    return ra->key < rb->key ? -1 : 1;
+}
+
+static int
+histrankcmp(const void *a, const void *b)
+{
+    const struct histrank *ra = a, *rb = b;
+
+    if (ra->score != rb->score)
+	return ra->score > rb->score ? -1 : 1;
+    if (ra->he->histnum != rb->he->histnum)
+	return ra->he->histnum > rb->he->histnum ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Return the most recent entry for each distinct line of the history,
+ * best ranked first, leaving out entries with any of xflags set.  The
+ * number of entries is returned in *countp; the array should be freed
+ * with zfree(ents, *countp * sizeof(Histent)) unless it is NULL.
+ */
+
+/**/
+mod_export Histent *
+histranked(int xflags, int *countp)
+{
+    struct histrank *ranks;
+    Histent he, *ents;
+    int n = 0, m = 0, i;
+
+    *countp = 0;
+    if (!hist_ring || !histlinect)
+	return NULL;
+    ranks = (struct histrank *)zalloc(histlinect * sizeof(*ranks));
+    for (he = hist_ring; he && n < histlinect; he = up_histent(he)) {
+	Histent key = NULL;
+
+	if (he == &curline || he->node.flags & xflags)
+	    continue;
 	if (he->node.flags & HIST_DUP)
-	    freehistnode(&he->node);
+	    key = (Histent)gethashnode2(histtab, he->node.nam);
+	ranks[n].key = key ? key : he;
+	ranks[n].he = he;
+	ranks[n].score = pow(0.5, (hist_ring->histnum - he->histnum) /
+			     HISTRANK_HALFLIFE);
+	n++;
+    }
+    /* Add up the scores of entries with the same text. */
+    qsort(ranks, n, sizeof(*ranks), histrankkeycmp);
+    for (i = 0; i < n; i++) {
+	if (m && ranks[m-1].key == ranks[i].key) {
+	    ranks[m-1].score += ranks[i].score;
+	    if (ranks[i].he->histnum > ranks[m-1].he->histnum)
+		ranks[m-1].he = ranks[i].he;
+	} else
+	    ranks[m++] = ranks[i];
     }
+    qsort(ranks, m, sizeof(*ranks), histrankcmp);
+    ents = m ? (Histent *)zalloc(m * sizeof(Histent)) : NULL;
+    for (i = 0; i < m; i++)
+	ents[i] = ranks[i].he;
+    zfree(ranks, histlinect * sizeof(*ranks));
+    *countp = m;
+    return ents;
 }
 
 /**/
@@ -1342,25 +2111,246 @@ putoldhistentryontop(short keep_going)
 	static zlong max_unique_ct = 0;
 	if (!keep_going)
 	    max_unique_ct = savehistsiz;
-	do {
-	    if (max_unique_ct-- <= 0 || he == hist_ring) {
+	/*
+	 * If no entries are missing from the middle of the ring,
+	 * the oldest duplicate's number says how far up it is,
+	 * so there's no need to go looking for it.
+	 */
+	if (!keep_going &&
+	    hist_ring->histnum - he->histnum + 1 == histlinect) {
+	    zlong pos = histdupct ? histdups[0]->histnum - he->histnum : 0;
+
+	    if (pos > 0 && pos <= max_unique_ct) {
+		he = histdups[0];
+		next = he->down;
+		max_unique_ct -= pos;
+	    } else {
 		max_unique_ct = 0;
-		he = hist_ring->down;
 		next = hist_ring;
+	    }
+	} else {
+	    do {
+		if (max_unique_ct-- <= 0 || he == hist_ring) {
+		    max_unique_ct = 0;
+		    he = hist_ring->down;
+		    next = hist_ring;
+		    break;
+		}
+		he = next;
+		next = he->down;
+	    } while (!(he->node.flags & HIST_DUP));
+	}
+    }
+    if (he != hist_ring->down) {
+	he->up->down = he->down;
+	he->down->up = he->up;
+	he->up = hist_ring;
+	he->down = hist_ring->down;
+	hist_ring->down = he->down->up = he;
+    }
+    hist_ring = he;
+}
+
+/* Space in the arena is handed out in multiples of this. */
+
+#define HISTARENA_ROUND(n) (((n) + sizeof(short) - 1) & ~(sizeof(short) - 1))
+
+/* Give back chunk i of arena a. */
+
+static void
+freehistchunk(struct histarena *a, int i)
+{
+    struct histchunk *c = a->chunks + i;
+
+    a->size -= c->size;
+    a->used -= c->used;
+    a->live -= c->live;
+    zfree(c->mem, c->size);
+    a->nchunks--;
+    memmove(c, c + 1, (a->nchunks - i) * sizeof(*c));
+    if (a->cur > i)
+	a->cur--;
+    else if (a->cur == i)
+	a->cur = -1;
+}
+
+/* Give back the whole of arena a. */
+
+static void
+freehistarena(struct histarena *a)
+{
+    int i;
+
+    for (i = 0; i < a->nchunks; i++)
+	zfree(a->chunks[i].mem, a->chunks[i].size);
+    if (a->chunks)
+	zfree(a->chunks, a->chunksiz * sizeof(*a->chunks));
+    memset(a, 0, sizeof(*a));
+    a->cur = -1;
+}
+
+/**/
+static void *
+histarenaalloc(size_t n)
+{
+    struct histarena *a = &histarena;
+    struct histchunk *c = a->cur >= 0 ? a->chunks + a->cur : NULL;
+    void *ret;
+
+    n = HISTARENA_ROUND(n);
+    if (!c || c->size - c->used < n) {
+	size_t size = n > HISTCHUNK_SIZE ? n : HISTCHUNK_SIZE;
+	char *mem;
+	int i;
+
+	if (c && !c->live)
+	    freehistchunk(a, a->cur);
+	mem = (char *)zalloc(size);
+	if (a->nchunks == a->chunksiz) {
+	    a->chunksiz = a->chunksiz ? 2 * a->chunksiz : 16;
+	    a->chunks = (struct histchunk *)
+		zrealloc(a->chunks, a->chunksiz * sizeof(*a->chunks));
+	}
+	for (i = a->nchunks; i > 0 && a->chunks[i-1].mem > mem; i--)
+	    a->chunks[i] = a->chunks[i-1];
+	c = a->chunks + i;
+	c->mem = mem;
+	c->size = size;
+	c->used = c->live = 0;
+	a->nchunks++;
+	a->cur = i;
+	a->size += size;
+    }
+    ret = c->mem + c->used;
+    c->used += n;
+    c->live += n;
+    a->used += n;
+    a->live += n;
+    return ret;
+}
+
+/**/
+static void
+histarenafree(void *p, size_t n)
+{
+    struct histarena *a = &histarena;
+    struct histchunk *c;
+    char *mem = (char *)p;
+    int lo = 0, hi = a->nchunks - 1;
+
+    /* Look for the last chunk that starts at or before p. */
+    while (lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+
+	if (a->chunks[mid].mem <= mem)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    c = a->chunks + lo;
+    if (!a->nchunks || mem < c->mem || mem >= c->mem + c->used) {
+	DPUTS(1, "BUG: history text not in arena");
+	return;
+    }
+    n = HISTARENA_ROUND(n);
+    c->live -= n;
+    a->live -= n;
+    if (!c->live) {
+	if (lo == a->cur) {
+	    a->used -= c->used;
+	    c->used = 0;
+	} else
+	    freehistchunk(a, lo);
+    }
+}
+
+/* Copy a history line into the arena. */
+
+/**/
+mod_export char *
+histstrdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+
+    return (char *)memcpy(histarenaalloc(len), s, len);
+}
+
+/* Copy the positions of nwords words into the arena. */
+
+/**/
+mod_export short *
+histwordsdup(short *words, int nwords)
+{
+    size_t len = 2 * nwords * sizeof(short);
+
+    if (!nwords)
+	return NULL;
+    return (short *)memcpy(histarenaalloc(len), words, len);
+}
+
+/* Free the text and words of a history entry. */
+
+/**/
+void
+freehisttext(Histent he)
+{
+    if (he->node.nam) {
+	histarenafree(he->node.nam, strlen(he->node.nam) + 1);
+	he->node.nam = NULL;
+    }
+    if (he->nwords) {
+	histarenafree(he->words, 2 * he->nwords * sizeof(short));
+	he->words = NULL;
+	he->nwords = 0;
+    }
+}
+
+/*
+ * If most of the arena is no longer used, copy the lines still in the
+ * history to a new one.  This moves the text of history entries, so
+ * it's only done when no-one can be holding on to it.
+ */
+
+/**/
+static void
+compacthistarena(void)
+{
+    struct histarena old = histarena;
+    Histent he;
+
+    if (old.used - old.live < 4 * HISTCHUNK_SIZE ||
+	old.used - old.live < old.live)
+	return;
+    memset(&histarena, 0, sizeof(histarena));
+    histarena.cur = -1;
+    if (hist_ring)
+	for (he = hist_ring->down; ; he = he->down) {
+	    if (he != &curline) {
+		if (he->node.nam)
+		    he->node.nam = histstrdup(he->node.nam);
+		if (he->nwords)
+		    he->words = histwordsdup(he->words, he->nwords);
+	    }
+	    if (he == hist_ring)
 		break;
-	    }
-	    he = next;
-	    next = he->down;
-	} while (!(he->node.flags & HIST_DUP));
-    }
-    if (he != hist_ring->down) {
-	he->up->down = he->down;
-	he->down->up = he->up;
-	he->up = hist_ring;
-	he->down = hist_ring->down;
-	hist_ring->down = he->down->up = he;
-    }
-    hist_ring = he;
+	}
+    freehistarena(&old);
+}
+
+/*
+ * Report the memory used for the text of the history:  the number of
+ * lines, the number of chunks, the bytes allocated and the bytes
+ * still in use.
+ */
+
+/**/
+mod_export void
+histarenastats(zlong *nlines, zlong *chunks, zlong *size, zlong *live)
+{
+    *nlines = histlinect;
+    *chunks = histarena.nchunks;
+    *size = histarena.size;
+    *live = histarena.live;
 }
 
 /**/
@@ -1376,6 +2366,7 @@ prepnexthistent(void)
 	curhist--;
 	freehistnode(&hist_ring->node);
     }
+    compacthistarena();
 
     if (histlinect < histsiz || !hist_ring) {
 	he = (Histent)zshcalloc(sizeof *he);
@@ -1481,6 +2472,7 @@ hend(Eprog prog)
 	unqueue_signals();
 	return 1;
     }
+    histstatusnum = 0;
     if (hist_ignore_all_dups != isset(HISTIGNOREALLDUPS)
      && (hist_ignore_all_dups = isset(HISTIGNOREALLDUPS)) != 0)
 	histremovedups();
@@ -1507,7 +2499,8 @@ hend(Eprog prog)
     }
     /* For history sharing, lock history file once for both read and write */
     hf = getsparam("HISTFILE");
-    if (isset(SHAREHISTORY) && !lockhistfile(hf, 0)) {
+    if (isset(SHAREHISTORY) &&
+	(isset(HISTATOMICAPPEND) || !lockhistfile(hf, 0))) {
 	readhistfile(hf, 0, HFILE_USE_OPTIONS | HFILE_FAST);
 	curline.histnum = curhist+1;
     }
@@ -1594,17 +2587,20 @@ hend(Eprog prog)
 	} else
 	    he = prepnexthistent();
 
-	he->node.nam = ztrdup(chline);
+	he->node.nam = histstrdup(chline);
 	he->stim = time(NULL);
 	he->ftim = 0L;
 	he->node.flags = newflags;
+	dircache_set(&he->dir, pwd);
+	if (!(newflags & HIST_TMPSTORE))
+	    histstatusnum = he->histnum;
 
-	if ((he->nwords = chwordpos/2)) {
-	    he->words = (short *)zalloc(chwordpos * sizeof(short));
-	    memcpy(he->words, chwords, chwordpos * sizeof(short));
-	}
+	if ((he->nwords = chwordpos/2))
+	    he->words = histwordsdup(chwords, he->nwords);
 	if (!(newflags & HIST_TMPSTORE))
 	    addhistnode(histtab, he->node.nam, he);
+	else
+	    histindexadd(he);
     }
     zfree(chline, hlinesz);
     zfree(chwords, chwordlen*sizeof(short));
@@ -1614,7 +2610,8 @@ hend(Eprog prog)
     /*
      * For normal INCAPPENDHISTORY case and reasoning, see hbegin().
      */
-    if (isset(SHAREHISTORY) ? histfileIsLocked() :
+    if (isset(SHAREHISTORY) ?
+	(isset(HISTATOMICAPPEND) || histfileIsLocked()) :
 	(isset(INCAPPENDHISTORY) || (isset(INCAPPENDHISTORYTIME) &&
 				     histsave_stack_pos != 0)))
 	savehistfile(hf, 0, HFILE_USE_OPTIONS | HFILE_FAST);
@@ -1815,6 +2812,7 @@ hconsearch(char *str, int *marg)
 	    continue;
 	if ((s = strstr(he->node.nam, str))) {
 	    int pos = s - he->node.nam;
+	    gethistwords(he);
 	    while (t1 < he->nwords && he->words[2*t1] <= pos)
 		t1++;
 	    *marg = t1 - 1;
@@ -2410,8 +3408,12 @@ gethist(int ev)
 static char *
 getargs(Histent elist, int arg1, int arg2)
 {
-    short *words = elist->words;
-    int pos1, pos2, nwords = elist->nwords;
+    short *words;
+    int pos1, pos2, nwords;
+
+    gethistwords(elist);
+    words = elist->words;
+    nwords = elist->nwords;
 
     if (arg2 < arg1 || arg1 >= nwords || arg2 >= nwords) {
 	/* remember, argN is indexed from 0, nwords is total no. of words */
@@ -2588,33 +3590,202 @@ resizehistents(void)
     }
 }
 
+/*
+ * Read a line of the history file held in memory at data, of size
+ * bytes, from offset *posp into *bufp, of size *bufsiz, starting at
+ * start.  A line ending in a backslash is joined to the next one with
+ * a newline.  Return the length, 0 at the end or -1 if the line is bad.
+ */
+
 static int
-readhistline(int start, char **bufp, int *bufsiz, FILE *in)
+readhistline(int start, char **bufp, int *bufsiz, char *data, off_t size,
+	     off_t *posp)
 {
-    char *buf = *bufp;
-    if (fgets(buf + start, *bufsiz - start, in)) {
-	int len = start + strlen(buf + start);
-	if (len == start)
-	    return -1;
-	if (buf[len - 1] != '\n') {
-	    if (!feof(in)) {
-		if (len < (*bufsiz) - 1)
-		    return -1;
-		*bufp = zrealloc(buf, 2 * (*bufsiz));
-		*bufsiz = 2 * (*bufsiz);
-		return readhistline(len, bufp, bufsiz, in);
-	    }
+    char *buf, *ptr = data + *posp, *nl;
+    int len;
+
+    if (*posp >= size)
+	return 0;
+    nl = memchr(ptr, '\n', size - *posp);
+    len = nl ? nl + 1 - ptr : size - *posp;
+    if (memchr(ptr, '\0', len))
+	return -1;
+    if (start + len >= *bufsiz) {
+	while (start + len >= *bufsiz)
+	    *bufsiz *= 2;
+	*bufp = zrealloc(*bufp, *bufsiz);
+    }
+    buf = *bufp;
+    memcpy(buf + start, ptr, len);
+    *posp += len;
+    len += start;
+    buf[len] = '\0';
+    if (nl) {
+	buf[len - 1] = '\0';
+	if (len > 1 && buf[len - 2] == '\\') {
+	    buf[--len - 1] = '\n';
+	    return readhistline(len, bufp, bufsiz, data, size, posp);
 	}
-	else {
-	    buf[len - 1] = '\0';
-	    if (len > 1 && buf[len - 2] == '\\') {
-		buf[--len - 1] = '\n';
-		if (!feof(in))
-		    return readhistline(len, bufp, bufsiz, in);
+    }
+    return len;
+}
+
+/*
+ * Entries read from a history file are only divided into words when
+ * the words are first needed, rather than all of them at startup.
+ * Do that now for he if it hasn't been done yet.
+ */
+
+/**/
+mod_export void
+gethistwords(Histent he)
+{
+    static short *words;
+    static int nwords;
+    int nwordpos = 0;
+
+    if (!(he->node.flags & HIST_NOWORDS))
+	return;
+    he->node.flags &= ~HIST_NOWORDS;
+    if (!words) {
+	nwords = 64;
+	words = (short *)zalloc(nwords*sizeof(short));
+    }
+    pushheap();
+    histsplitwords(he->node.nam, &words, &nwords, &nwordpos,
+		   isset(HISTLEXWORDS) && !(he->node.flags & HIST_FOREIGN));
+    popheap();
+
+    he->nwords = nwordpos/2;
+    he->words = histwordsdup(words, he->nwords);
+}
+
+/*
+ * With HIST_WATCH_FILE set, an inotify watch on the directory holding
+ * the history file tells us whether the file may have changed since we
+ * last looked, so that shells sharing history needn't examine the file
+ * before every command.  histwatch_changed is set when there has been
+ * some activity and cleared when readhistfile() has caught up.
+ */
+static int histwatch_changed;
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int histwatch_fd = -1;
+static char *histwatch_file, *histwatch_name;
+
+static void
+histunwatch(int doclose)
+{
+    if (histwatch_fd >= 0 && doclose)
+	zclose(histwatch_fd);
+    histwatch_fd = -1;
+    zsfree(histwatch_file);
+    histwatch_file = NULL;
+}
+#endif
+
+/*
+ * Discard changes to the history file reported so far: called when
+ * we know the file contains nothing we haven't seen.
+ */
+
+static void
+histwatchsync(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    char buf[4096];
+
+    if (histwatch_fd >= 0)
+	while (read(histwatch_fd, buf, sizeof(buf)) > 0)
+	    ;
+#endif
+    histwatch_changed = 0;
+}
+
+/*
+ * Return 1 if the history file fn may have changed since it was last
+ * read, 0 if we know it hasn't.
+ */
+
+static int
+histfilechanged(char *fn)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    union {
+	struct inotify_event ev;
+	char buf[4096];
+    } u;
+    struct inotify_event *ev;
+    char *ptr, *dir;
+    ssize_t len;
+    int fd;
+
+    if (!isset(HISTWATCHFILE)) {
+	if (histwatch_fd >= 0)
+	    histunwatch(1);
+	return 1;
+    }
+    fn = unmeta(fn);
+    if (histwatch_fd >= 0 && !strcmp(fn, histwatch_file)) {
+	int gone = 0;
+
+	while ((len = read(histwatch_fd, u.buf, sizeof(u.buf))) > 0) {
+	    for (ptr = u.buf; ptr < u.buf + len;
+		 ptr += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)ptr;
+		if ((ev->mask & (IN_Q_OVERFLOW|IN_IGNORED)) ||
+		    (ev->len && !strcmp(ev->name, histwatch_name)))
+		    histwatch_changed = 1;
+		/* The directory itself has gone. */
+		if (ev->mask & IN_IGNORED)
+		    gone = 1;
 	    }
 	}
-	return len;
+	if (len < 0 && errno == EINTR)
+	    return 1;
+	if (gone || (len < 0 && errno != EAGAIN)) {
+	    /* Start again next time; the fd isn't ours if it's bad. */
+	    histunwatch(gone || errno != EBADF);
+	    return 1;
+	}
+	return histwatch_changed;
     }
+    histunwatch(1);
+    histwatch_changed = 1;
+    /* A relative path may refer to a different directory later. */
+    if (*fn != '/' || (fd = inotify_init1(IN_NONBLOCK)) < 0)
+	return 1;
+    histwatch_file = ztrdup(fn);
+    histwatch_name = strrchr(histwatch_file, '/') + 1;
+    if (histwatch_name == histwatch_file + 1)
+	dir = "/";
+    else
+	dir = dupstrpfx(histwatch_file, histwatch_name - histwatch_file - 1);
+    if (inotify_add_watch(fd, dir, IN_MODIFY | IN_ATTRIB | IN_CREATE |
+			  IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+	close(fd);
+	histunwatch(0);
+    } else if ((histwatch_fd = movefd(fd)) < 0)
+	histunwatch(0);
+#endif
+    return 1;
+}
+
+/*
+ * Read the start of the history file, up to head, into data if that was
+ * skipped by readhistfile().  Returns non-zero if it can't be read.
+ */
+
+/**/
+static int
+readhisthead(int fd, char *data, off_t *head)
+{
+    if (!*head)
+	return 0;
+    if (lseek(fd, 0, SEEK_SET) == -1 ||
+	read_loop(fd, data, *head) != (ssize_t) *head)
+	return 1;
+    *head = 0;
     return 0;
 }
 
@@ -2622,29 +3793,42 @@ readhistline(int start, char **bufp, int *bufsiz, FILE *in)
 void
 readhistfile(char *fn, int err, int readflags)
 {
-    char *buf, *start = NULL;
-    FILE *in;
+    char *buf, *data = NULL, *start = NULL;
     Histent he;
     time_t stim, ftim, tim = time(NULL);
-    off_t fpos;
-    short *words;
+    off_t fpos, pos, end, size = 0, head = 0;
     struct stat sb;
-    int nwordpos, nwords, bufsiz;
-    int searching, newflags, l, ret, uselex;
+    int bufsiz, mapped = 0, locked = 0;
+    int fd, searching, newflags, l, ret;
 
     if (!fn && !(fn = getsparam("HISTFILE")))
 	return;
+    if (readflags & HFILE_FAST && !lasthist.interrupted &&
+	!histfilechanged(fn))
+	return;
     if (stat(unmeta(fn), &sb) < 0 ||
 	sb.st_size == 0)
 	return;
     if (readflags & HFILE_FAST) {
-	if (!lasthist.interrupted &&
-	    ((lasthist.fsiz == sb.st_size && lasthist.mtim == sb.st_mtime)
-	     || lockhistfile(fn, 0)))
-	    return;
+	if (!lasthist.interrupted) {
+	    if (lasthist.fsiz == sb.st_size && lasthist.mtim == sb.st_mtime) {
+		histwatch_changed = 0;
+		return;
+	    }
+	    /*
+	     * With HIST_ATOMIC_APPEND lines are added to the file
+	     * whole, so there's no need to lock it to read them.
+	     */
+	    if (!isset(HISTATOMICAPPEND)) {
+		if (lockhistfile(fn, 0))
+		    return;
+		locked = 1;
+	    }
+	}
 	lasthist.fsiz = sb.st_size;
 	lasthist.mtim = sb.st_mtime;
 	lasthist.interrupted = 0;
+	histwatch_changed = 0;
     } else if ((ret = lockhistfile(fn, 1))) {
 	if (ret == 2) {
 	    zwarn("locking failed for %s: %e: reading anyway", fn, errno);
@@ -2652,38 +3836,102 @@ readhistfile(char *fn, int err, int readflags)
 	    zerr("locking failed for %s: %e", fn, errno);
 	    return;
 	}
+    } else
+	locked = 1;
+    /*
+     * The file is mapped, or else read, as a whole.  Lines are taken
+     * from it one at a time; they are only divided into words when
+     * that's needed, see gethistwords().
+     *
+     * It's only mapped while it's locked: another shell may truncate
+     * it, and touching a mapped page past the new end raises SIGBUS.
+     * Without the lock it's read instead, and a fast read that is
+     * likely to carry on from the last line we saw only reads from
+     * there; the rest is read if it turns out to be needed after all.
+     */
+    if ((fd = open(unmeta(fn), O_RDONLY | O_NOCTTY)) >= 0 &&
+	!fstat(fd, &sb) && (size = sb.st_size) > 0) {
+#ifdef USE_MMAP
+	if (locked) {
+	    data = (char *) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	    if (data == (char *) MAP_FAILED)
+		data = NULL;
+	    else
+		mapped = 1;
+	}
+#endif
+	if (!data) {
+	    if (readflags & HFILE_FAST && lasthist.text && lasthist.fend &&
+		lasthist.dev == sb.st_dev && lasthist.ino == sb.st_ino &&
+		lasthist.fpos < lasthist.fend && lasthist.fend <= size)
+		head = lasthist.fpos;
+	    data = (char *) zalloc(size);
+	    if (lseek(fd, head, SEEK_SET) == -1 ||
+		read_loop(fd, data + head, size - head) !=
+		(ssize_t) (size - head)) {
+		zfree(data, size);
+		data = NULL;
+	    }
+	}
     }
-    if ((in = fopen(unmeta(fn), "r"))) {
-	nwords = 64;
-	words = (short *)zalloc(nwords*sizeof(short));
+    if (data) {
 	bufsiz = 1024;
 	buf = zalloc(bufsiz);
+	pos = 0;
+	/*
+	 * A line without a newline at the end of the file may still be
+	 * being written by another shell; leave it for next time.
+	 */
+	end = size;
+	if (readflags & HFILE_FAST)
+	    for (;;) {
+		while (end > head && data[end - 1] != '\n')
+		    end--;
+		if (end > head || !head || readhisthead(fd, data, &head))
+		    break;
+	    }
 
 	pushheap();
 	if (readflags & HFILE_FAST && lasthist.text) {
-	    if (lasthist.fpos < lasthist.fsiz) {
-		fseek(in, lasthist.fpos, 0);
+	    /*
+	     * If this is still the file we've been reading and it
+	     * hasn't shrunk, only new lines have been added to it:
+	     * check that the last line we saw is still where we left
+	     * it and carry on from there.  Otherwise we need to rescan
+	     * the file to find where we had got to.
+	     */
+	    if (lasthist.dev != sb.st_dev || lasthist.ino != sb.st_ino)
+		lasthist.nown = 0;
+	    if (lasthist.fend ?
+		(lasthist.dev == sb.st_dev && lasthist.ino == sb.st_ino &&
+		 lasthist.fend <= end && lasthist.fpos < lasthist.fend) :
+		lasthist.fpos < lasthist.fsiz) {
+		pos = lasthist.fpos;
 		searching = 1;
 	    }
 	    else {
 		histfile_linect = 0;
 		searching = -1;
+		if (readhisthead(fd, data, &head))
+		    end = 0;
 	    }
 	} else
 	    searching = 0;
 
-	newflags = HIST_OLD | HIST_READ;
+	newflags = HIST_OLD | HIST_READ | HIST_NOWORDS;
 	if (readflags & HFILE_FAST)
 	    newflags |= HIST_FOREIGN;
 	if (readflags & HFILE_SKIPOLD
 	 || (hist_ignore_all_dups && newflags & hist_skip_flags))
 	    newflags |= HIST_MAKEUNIQUE;
-	while (fpos = ftell(in), (l = readhistline(0, &buf, &bufsiz, in))) {
+	while (fpos = pos,
+	       (l = readhistline(0, &buf, &bufsiz, data, end, &pos))) {
 	    char *pt;
 	    int remeta = 0;
 
 	    if (l < 0) {
 		zerr("corrupt history file %s", fn);
+		pos = 0;
 		break;
 	    }
 
@@ -2734,12 +3982,15 @@ readhistfile(char *fn, int err, int readflags)
 	    if (searching) {
 		if (searching > 0) {
 		    if (stim == lasthist.stim
-		     && histstrcmp(pt, lasthist.text) == 0)
+		     && histstrcmp(pt, lasthist.text) == 0
+		     && (!lasthist.fend || pos == lasthist.fend))
 			searching = 0;
 		    else {
-			fseek(in, 0, 0);
+			pos = 0;
 			histfile_linect = 0;
 			searching = -1;
+			if (readhisthead(fd, data, &head))
+			    break;
 		    }
 		    continue;
 		}
@@ -2751,13 +4002,25 @@ readhistfile(char *fn, int err, int readflags)
 	    }
 
 	    if (readflags & HFILE_USE_OPTIONS) {
-		histfile_linect++;
+		/* Skip lines we wrote ourselves, already counted. */
+		while (lasthist.nown && lasthist.ownend[0] <= fpos) {
+		    lasthist.nown--;
+		    memmove(lasthist.ownbeg, lasthist.ownbeg + 1,
+			    lasthist.nown * sizeof(off_t));
+		    memmove(lasthist.ownend, lasthist.ownend + 1,
+			    lasthist.nown * sizeof(off_t));
+		}
 		lasthist.fpos = fpos;
 		lasthist.stim = stim;
+		if (lasthist.nown && lasthist.ownbeg[0] <= fpos) {
+		    start = pt;
+		    continue;
+		}
+		histfile_linect++;
 	    }
 
 	    he = prepnexthistent();
-	    he->node.nam = ztrdup(pt);
+	    he->node.nam = histstrdup(pt);
 	    he->node.flags = newflags;
 	    if ((he->stim = stim) == 0)
 		he->stim = he->ftim = tim;
@@ -2766,19 +4029,9 @@ readhistfile(char *fn, int err, int readflags)
 	    else
 		he->ftim = ftim;
 
-	    /*
-	     * Divide up the words.
-	     */
 	    start = pt;
-	    uselex = isset(HISTLEXWORDS) && !(readflags & HFILE_FAST);
-	    histsplitwords(pt, &words, &nwords, &nwordpos, uselex);
-
-	    he->nwords = nwordpos/2;
-	    if (he->nwords) {
-		he->words = (short *)zalloc(nwordpos*sizeof(short));
-		memcpy(he->words, words, nwordpos*sizeof(short));
-	    } else
-		he->words = (short *)NULL;
+	    he->words = (short *)NULL;
+	    he->nwords = 0;
 	    addhistnode(histtab, he->node.nam, he);
 	    if (he->node.flags & HIST_DUP) {
 		freehistnode(&he->node);
@@ -2788,7 +4041,7 @@ readhistfile(char *fn, int err, int readflags)
 	     * Do this last out of paranoia in case use of
 	     * heap is disguised...
 	     */
-	    if (uselex || remeta)
+	    if (remeta)
 		freeheap();
 	    if (errflag & ERRFLAG_INT) {
 		/* Can't assume fast read next time if interrupted. */
@@ -2800,15 +4053,29 @@ readhistfile(char *fn, int err, int readflags)
 	    zsfree(lasthist.text);
 	    lasthist.text = ztrdup(start);
 	}
-	zfree(words, nwords*sizeof(short));
+	if (readflags & HFILE_USE_OPTIONS) {
+	    /* Only trust where we stopped if it was after a whole line. */
+	    lasthist.fend = (lasthist.text && pos && !searching &&
+			     data[pos - 1] == '\n') ? pos : 0;
+	    lasthist.dev = sb.st_dev;
+	    lasthist.ino = sb.st_ino;
+	}
 	zfree(buf, bufsiz);
 
 	popheap();
-	fclose(in);
-    } else if (err)
+#ifdef USE_MMAP
+	if (mapped)
+	    munmap(data, size);
+	else
+#endif
+	    zfree(data, size);
+    } else if (err && (fd < 0 || size))
 	zerr("can't read history file %s", fn);
+    if (fd >= 0)
+	close(fd);
 
-    unlockhistfile(fn);
+    if (locked)
+	unlockhistfile(fn);
 
     if (zleactive)
 	zleentry(ZLE_CMD_SET_HIST_LINE, curhist);
@@ -2862,16 +4129,148 @@ flockhistfile(char *fn, int keep_trying)
 }
 #endif
 
+/*
+ * Add the line for history entry he as it appears in the history file
+ * to *bufp at offset len, enlarging the buffer (on the heap) as
+ * necessary, and return the new length.
+ */
+
+static size_t
+histfileline(Histent he, int extended_history, char **bufp, size_t *bufsizp,
+	     size_t len)
+{
+    char *t = he->node.nam, *ptr;
+    size_t need = len + 2 * strlen(t) + 64;
+    int count_backslashes = 0;
+
+    if (need > *bufsizp) {
+	*bufp = hrealloc(*bufp, *bufsizp, need * 2);
+	*bufsizp = need * 2;
+    }
+    ptr = *bufp + len;
+    if (extended_history) {
+	sprintf(ptr, ": %ld:%ld;", (long)he->stim,
+		he->ftim? (long)(he->ftim - he->stim) : 0L);
+	ptr += strlen(ptr);
+    } else if (*t == ':')
+	*ptr++ = '\\';
+
+    for (; *t; t++) {
+	if (*t == '\n')
+	    *ptr++ = '\\';
+	if (*t == '\\')
+	    count_backslashes++;
+	else
+	    count_backslashes = 0;
+	*ptr++ = *t;
+    }
+    if (count_backslashes && (count_backslashes % 2 == 0))
+	*ptr++ = ' ';
+    *ptr++ = '\n';
+
+    return ptr - *bufp;
+}
+
+/*
+ * Return 1 if another shell has the history file locked; fd is open
+ * on the file.
+ */
+
+static int
+histfilebusy(char *fn, int fd)
+{
+    struct stat sb;
+    char *lockfile;
+    int ret;
+
+#ifdef HAVE_FCNTL_H
+    if (isset(HISTFCNTLLOCK)) {
+	struct flock lck;
+
+	lck.l_type = F_WRLCK;
+	lck.l_whence = SEEK_SET;
+	lck.l_start = 0;
+	lck.l_len = 0;
+	return fcntl(fd, F_GETLK, &lck) == 0 && lck.l_type != F_UNLCK;
+    }
+#endif
+    lockfile = bicat(unmeta(fn), ".LOCK");
+    ret = lstat(lockfile, &sb) == 0;
+    free(lockfile);
+    return ret;
+}
+
+/*
+ * With HIST_ATOMIC_APPEND, add the lines in buf to the history file
+ * with a single write() and no lock.  last is the offset in buf of
+ * the last line, from entry he.  Return -1 on failure.
+ */
+
+static int
+atomicappend(char *fn, FILE *out, char *buf, size_t len, size_t last,
+	     Histent he, int writeflags)
+{
+    struct stat sb, nsb;
+    off_t beg, end;
+    int fd = fileno(out), tries = 0;
+
+    for (;;) {
+	if (write(fd, buf, len) != (ssize_t)len || fstat(fd, &sb) < 0 ||
+	    (end = lseek(fd, 0, SEEK_CUR)) < 0)
+	    return -1;
+	/*
+	 * If another shell is replacing the file by a trimmed copy,
+	 * the lines may have gone to the old one.  Wait till it's
+	 * finished and if so add them again.
+	 */
+	if (tries++ || !histfilebusy(fn, fd))
+	    break;
+	if (!lockhistfile(fn, 1))
+	    unlockhistfile(fn);
+	if (stat(unmeta(fn), &nsb) < 0 ||
+	    (nsb.st_dev == sb.st_dev && nsb.st_ino == sb.st_ino))
+	    break;
+	if ((fd = open(unmeta(fn), O_WRONLY | O_APPEND | O_NOCTTY)) < 0)
+	    return -1;
+	redup(fd, fileno(out));
+	fd = fileno(out);
+    }
+    if (!(writeflags & HFILE_USE_OPTIONS))
+	return 0;
+    beg = end - len;
+    if (beg == lasthist.fend &&
+	(!beg || (lasthist.dev == sb.st_dev && lasthist.ino == sb.st_ino))) {
+	/* Nobody else got in first, so we've still read everything. */
+	lasthist.fpos = beg + last;
+	lasthist.stim = he->stim;
+	lasthist.fsiz = lasthist.fend = end;
+	lasthist.mtim = sb.st_mtime;
+	lasthist.dev = sb.st_dev;
+	lasthist.ino = sb.st_ino;
+	zsfree(lasthist.text);
+	lasthist.text = ztrdup(he->node.nam);
+    } else {
+	/* Make sure we look at the file next time. */
+	lasthist.fsiz = 0;
+	if (lasthist.nown < HIST_OWN_MAX &&
+	    lasthist.dev == sb.st_dev && lasthist.ino == sb.st_ino) {
+	    lasthist.ownbeg[lasthist.nown] = beg;
+	    lasthist.ownend[lasthist.nown++] = end;
+	}
+    }
+    return 0;
+}
+
 /**/
 void
 savehistfile(char *fn, int err, int writeflags)
 {
-    char *t, *tmpfile, *start = NULL;
+    char *tmpfile, *start = NULL;
     FILE *out;
     Histent he;
     zlong xcurhist = curhist - !!(histactive & HA_ACTIVE);
     int extended_history = isset(EXTENDEDHISTORY);
-    int ret;
+    int ret, atomic = 0, bgrewrite = 0;
 
     if (!interact || savehistsiz <= 0 || !hist_ring
      || (!fn && !(fn = getsparam("HISTFILE"))))
@@ -2882,10 +4281,24 @@ savehistfile(char *fn, int err, int writeflags)
 	    lasthist.next_write_ev = he->histnum + 1;
 	    he = down_histent(he);
 	}
-	if (!he || lockhistfile(fn, 0))
+	if (!he)
 	    return;
-	if (histfile_linect > savehistsiz + savehistsiz / 5)
-	    writeflags &= ~HFILE_FAST;
+	/*
+	 * With HIST_ATOMIC_APPEND, the lock is only needed to trim
+	 * the file; if we can't get it, just append this time.
+	 */
+	if (isset(HISTATOMICAPPEND)) {
+	    if (histfile_linect <= savehistsiz + savehistsiz / 5 ||
+		lockhistfile(fn, 0))
+		atomic = 1;
+	    else
+		writeflags &= ~HFILE_FAST;
+	} else {
+	    if (lockhistfile(fn, 0))
+		return;
+	    if (histfile_linect > savehistsiz + savehistsiz / 5)
+		writeflags &= ~HFILE_FAST;
+	}
     }
     else {
 	if (lockhistfile(fn, 1)) {
@@ -2910,6 +4323,9 @@ savehistfile(char *fn, int err, int writeflags)
 	int fd = open(unmeta(fn), O_CREAT | O_WRONLY | O_APPEND | O_NOCTTY, 0600);
 	tmpfile = NULL;
 	out = fd >= 0 ? fdopen(fd, "a") : NULL;
+	/* Otherwise ftell() doesn't say where the first line goes. */
+	if (out && !atomic)
+	    fseek(out, 0, SEEK_END);
     } else if (!isset(HISTSAVEBYCOPY)) {
 	int fd = open(unmeta(fn), O_CREAT | O_WRONLY | O_TRUNC | O_NOCTTY, 0600);
 	tmpfile = NULL;
@@ -2960,8 +4376,24 @@ savehistfile(char *fn, int err, int writeflags)
 	}
     }
     if (out) {
-	char *history_ignore;
+	char *history_ignore, *buf = NULL;
+	size_t bufsiz = 0, len = 0, last = 0;
+	Histent lasthe = NULL;
 	Patprog histpat = NULL;
+	/*
+	 * If we're appending to a file we've read right up to the
+	 * end, we'll still have read all of it after writing.
+	 */
+	int uptodate = 1;
+
+	if (writeflags & HFILE_APPEND && !atomic) {
+	    struct stat sb;
+	    uptodate = (fstat(fileno(out), &sb) == 0 &&
+			(sb.st_size == 0 ||
+			 (lasthist.fend && lasthist.fend == sb.st_size &&
+			  lasthist.dev == sb.st_dev &&
+			  lasthist.ino == sb.st_ino)));
+	}
 
 	pushheap();
 
@@ -2973,8 +4405,6 @@ savehistfile(char *fn, int err, int writeflags)
 
 	ret = 0;
 	for (; he && he->histnum <= xcurhist; he = down_histent(he)) {
-	    int count_backslashes = 0;
-
 	    if ((writeflags & HFILE_SKIPDUPS && he->node.flags & HIST_DUP)
 	     || (writeflags & HFILE_SKIPFOREIGN && he->node.flags & HIST_FOREIGN)
 	     || he->node.flags & HIST_TMPSTORE)
@@ -2990,44 +4420,44 @@ savehistfile(char *fn, int err, int writeflags)
 		if (writeflags & HFILE_USE_OPTIONS)
 		    lasthist.next_write_ev = he->histnum + 1;
 	    }
+	    if (writeflags & HFILE_USE_OPTIONS)
+		histfile_linect++;
+	    if (atomic) {
+		/* Collect the lines to write them all at once below. */
+		last = len;
+		len = histfileline(he, extended_history, &buf, &bufsiz, len);
+		lasthe = he;
+		continue;
+	    }
 	    if (writeflags & HFILE_USE_OPTIONS) {
 		lasthist.fpos = ftell(out);
 		lasthist.stim = he->stim;
-		histfile_linect++;
-	    }
-	    t = start = he->node.nam;
-	    if (extended_history) {
-		ret = fprintf(out, ": %ld:%ld;", (long)he->stim,
-			      he->ftim? (long)(he->ftim - he->stim) : 0L);
-	    } else if (*t == ':')
-		ret = fputc('\\', out);
-
-	    for (; ret >= 0 && *t; t++) {
-		if (*t == '\n')
-		    if ((ret = fputc('\\', out)) < 0)
-			break;
-		if (*t == '\\')
-		    count_backslashes++;
-		else
-		    count_backslashes = 0;
-		if ((ret = fputc(*t, out)) < 0)
-		    break;
 	    }
-	    if (ret < 0)
-	    	break;
-	    if (count_backslashes && (count_backslashes % 2 == 0))
-		if ((ret = fputc(' ', out)) < 0)
-		    break;
-	    if (ret < 0 || (ret = fputc('\n', out)) < 0)
+	    start = he->node.nam;
+	    len = histfileline(he, extended_history, &buf, &bufsiz, 0);
+	    if (fwrite(buf, 1, len, out) != len) {
+		ret = -1;
 		break;
+	    }
 	}
-	if (ret >= 0 && start && writeflags & HFILE_USE_OPTIONS) {
+	if (atomic) {
+	    if (lasthe)
+		ret = atomicappend(fn, out, buf, len, last, lasthe, writeflags);
+	} else if (ret >= 0 && start && writeflags & HFILE_USE_OPTIONS) {
 	    struct stat sb;
 	    if ((ret = fflush(out)) >= 0) {
 		if (fstat(fileno(out), &sb) == 0) {
-		    lasthist.fsiz = sb.st_size;
+		    /* If not, make sure we look at the file next time. */
+		    lasthist.fsiz = uptodate ? sb.st_size : 0;
 		    lasthist.mtim = sb.st_mtime;
-		}
+		    lasthist.fend = uptodate ? sb.st_size : 0;
+		    lasthist.dev = sb.st_dev;
+		    lasthist.ino = sb.st_ino;
+		    /* Don't be woken up by our own changes. */
+		    if (uptodate)
+			histwatchsync();
+		} else
+		    lasthist.fend = 0;
 		zsfree(lasthist.text);
 		lasthist.text = ztrdup(start);
 	    }
@@ -3054,21 +4484,17 @@ savehistfile(char *fn, int err, int writeflags)
 
 	    if (ret >= 0 && writeflags & HFILE_SKIPOLD
 		&& !(writeflags & (HFILE_FAST | HFILE_NO_REWRITE))) {
-		int remember_histactive = histactive;
-
-		/* Zeroing histactive avoids unnecessary munging of curline. */
-		histactive = 0;
-		/* The NULL leaves HISTFILE alone, preserving fn's value. */
-		pushhiststack(NULL, savehistsiz, savehistsiz, -1);
-
-		hist_ignore_all_dups |= isset(HISTSAVENODUPS);
-		readhistfile(fn, err, 0);
-		hist_ignore_all_dups = isset(HISTIGNOREALLDUPS);
-		if (histlinect)
-		    savehistfile(fn, err, 0);
-
-		pophiststack();
-		histactive = remember_histactive;
+		/*
+		 * With HIST_BG_REWRITE, leave it to a child once
+		 * we've let go of the lock.
+		 */
+		if (isset(HISTBGREWRITE))
+		    bgrewrite = 1;
+		else
+		    rewritehistfile(fn, err);
+		/* The file has been rewritten, our offsets are no use. */
+		lasthist.fend = 0;
+		lasthist.nown = 0;
 	    }
 	}
 
@@ -3085,11 +4511,58 @@ savehistfile(char *fn, int err, int writeflags)
     if (tmpfile)
 	free(tmpfile);
 
-    unlockhistfile(fn);
+    if (!atomic)
+	unlockhistfile(fn);
+    if (bgrewrite && bgrewritehistfile(fn))
+	rewritehistfile(fn, err);
+}
+
+/*
+ * Rewrite the history file fn so that it only contains the last
+ * $SAVEHIST lines, dropping duplicates if HIST_SAVE_NO_DUPS is set.
+ */
+
+/**/
+static void
+rewritehistfile(char *fn, int err)
+{
+    int remember_histactive = histactive;
+    zlong linect;
+
+    /* Zeroing histactive avoids unnecessary munging of curline. */
+    histactive = 0;
+    /* The NULL leaves HISTFILE alone, preserving fn's value. */
+    pushhiststack(NULL, savehistsiz, savehistsiz, -1);
+
+    hist_ignore_all_dups |= isset(HISTSAVENODUPS);
+    readhistfile(fn, err, 0);
+    hist_ignore_all_dups = isset(HISTIGNOREALLDUPS);
+    if ((linect = histlinect))
+	savehistfile(fn, err, 0);
+
+    pophiststack();
+    histactive = remember_histactive;
+    /* Otherwise we'd rewrite the file again on every save. */
+    histfile_linect = linect;
 }
 
 static int lockhistct;
 
+/* Total time spent getting the lock on the history file, in microseconds */
+
+/**/
+zlong histlockwait;
+
+static void
+addlockwait(struct timespec *then)
+{
+    struct timespec now;
+
+    zgettime_monotonic_if_available(&now);
+    histlockwait += (zlong)(now.tv_sec - then->tv_sec) * 1000000 +
+	(now.tv_nsec - then->tv_nsec) / 1000;
+}
+
 static int
 checklocktime(char *lockfile, long *sleep_usp, time_t then)
 {
@@ -3137,6 +4610,7 @@ lockhistfile(char *fn, int keep_trying)
 
     if (!lockhistct++) {
 	struct stat sb;
+	struct timespec then;
 	int fd;
 	char *lockfile;
 #ifdef HAVE_LINK
@@ -3147,9 +4621,13 @@ lockhistfile(char *fn, int keep_trying)
 # endif
 #endif
 
+	zgettime_monotonic_if_available(&then);
 #ifdef HAVE_FCNTL_H
-	if (isset(HISTFCNTLLOCK))
-	    return flockhistfile(fn, keep_trying);
+	if (isset(HISTFCNTLLOCK)) {
+	    ret = flockhistfile(fn, keep_trying);
+	    addlockwait(&then);
+	    return ret;
+	}
 #endif
 
 	lockfile = bicat(unmeta(fn), ".LOCK");
@@ -3247,6 +4725,7 @@ lockhistfile(char *fn, int keep_trying)
 	}
 #endif /* not HAVE_LINK */
 	free(lockfile);
+	addlockwait(&then);
     }
 
     if (ct == lockhistct) {
@@ -3299,6 +4778,70 @@ histfileIsLocked(void)
     return lockhistct > 0;
 }
 
+/*
+ * Start rewriting the history file fn in the background.  The
+ * child is detached from the terminal so that it can finish after
+ * the shell has exited; it writes a new file and renames it over
+ * the old one, so other shells can keep appending meanwhile.
+ * Return 0 if the child was started.
+ */
+
+/**/
+static int
+bgrewritehistfile(char *fn)
+{
+    pid_t pid;
+    int fd;
+
+    queue_signals();
+    if ((pid = fork()) == -1) {
+	unqueue_signals();
+	return 1;
+    }
+    if (!pid) {
+#ifdef HAVE_SETSID
+	setsid();
+#else
+	signal_ignore(SIGHUP);
+	signal_ignore(SIGINT);
+	signal_ignore(SIGQUIT);
+#endif
+	if (!fork()) {
+	    mypid = (zlong)getpid();
+	    lockhistct = 0;
+#ifdef HAVE_FCNTL_H
+	    if (flock_fd >= 0) {
+		close(flock_fd);
+		flock_fd = -1;
+	    }
+#endif
+	    /* Don't keep the terminal or anything else of ours open */
+	    closem(FDT_UNUSED, 1);
+	    for (fd = 3; fd < 10; fd++)
+		close(fd);
+	    if ((fd = open("/dev/null", O_RDWR | O_NOCTTY)) != -1) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (fd > 2)
+		    close(fd);
+	    }
+	    opts[HISTSAVEBYCOPY] = 1;
+	    if (lockhistfile(fn, 1))
+		_exit(1);
+	    rewritehistfile(fn, 0);
+	    unlockhistfile(fn);
+	    _exit(0);
+	}
+	_exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    unqueue_signals();
+    /* Assume the child trims the file as we would have done. */
+    histfile_linect = savehistsiz;
+    return 0;
+}
+
 /*
  * Get the words in the current buffer. Using the lexer. 
  *
@@ -3809,6 +5352,12 @@ pushhiststack(char *hf, zlong hs, zlong shs, int level)
     } else
 	h->histfile = NULL;
     h->histtab = histtab;
+    h->histdups = histdups;
+    h->histdupct = histdupct;
+    h->histdupsiz = histdupsiz;
+    h->histidx = histidx;
+    h->histarena = histarena;
+    h->histstatusnum = histstatusnum;
     h->hist_ring = hist_ring;
     h->curhist = curhist;
     h->histlinect = histlinect;
@@ -3824,6 +5373,12 @@ pushhiststack(char *hf, zlong hs, zlong shs, int level)
 	    unsetparam("HISTFILE");
     }
     hist_ring = NULL;
+    histdups = NULL;
+    histdupct = histdupsiz = 0;
+    histidx = NULL;
+    memset(&histarena, 0, sizeof(histarena));
+    histarena.cur = -1;
+    histstatusnum = 0;
     curhist = histlinect = 0;
     if (zleactive)
 	zleentry(ZLE_CMD_SET_HIST_LINE, curhist);
@@ -3852,6 +5407,11 @@ pophiststack(void)
 	unlinkcurline();
 
     deletehashtable(histtab);
+    DPUTS(histdupct, "BUG: duplicate history entries left behind");
+    if (histdups)
+	zfree(histdups, histdupsiz * sizeof(Histent));
+    freehistindex();
+    freehistarena(&histarena);
     zsfree(lasthist.text);
 
     h = &histsave_stack[--histsave_stack_pos];
@@ -3864,6 +5424,12 @@ pophiststack(void)
 	    unsetparam("HISTFILE");
     }
     histtab = h->histtab;
+    histdups = h->histdups;
+    histdupct = h->histdupct;
+    histdupsiz = h->histdupsiz;
+    histidx = h->histidx;
+    histarena = h->histarena;
+    histstatusnum = h->histstatusnum;
     hist_ring = h->hist_ring;
     curhist = h->curhist;
     if (zleactive)
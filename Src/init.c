@@ -98,6 +98,10 @@ mod_export struct hookdef zshhooks[] = {
     HOOKDEF("before_trap", NULL, HOOKF_ALL),
     HOOKDEF("after_trap", NULL, HOOKF_ALL),
     HOOKDEF("get_color_attr", NULL, HOOKF_ALL),
+    HOOKDEF("after_command", NULL, HOOKF_ALL),
+    HOOKDEF("before_fork", NULL, HOOKF_ALL),
+    HOOKDEF("before_exec", NULL, HOOKF_ALL),
+    HOOKDEF("idle", NULL, HOOKF_ALL),
 };
 
 /* keep executing lists until EOF found */
@@ -115,6 +119,8 @@ loop(int toplevel, int justonce)
 	zcontext_save();
     for (;;) {
 	freeheap();
+	if (toplevel)
+	    trimheappool();
 	if (stophist == 3)	/* re-entry via preprompt() */
 	    hend(NULL);
 	hbegin(1);		/* init history mech        */
@@ -210,9 +216,12 @@ loop(int toplevel, int justonce)
 	    if (stopmsg)	/* unset 'you have stopped jobs' flag */
 		stopmsg--;
 	    execode(prog, 0, 0, toplevel ? "toplevel" : "file");
+	    runhookdef(AFTERCOMMANDHOOK, NULL);
 	    tok = toksav;
-	    if (toplevel)
+	    if (toplevel) {
 		noexitct = 0;
+		sethiststatus(lastval);
+	    }
 	}
 	if (ferror(stderr)) {
 	    zerr("write error");
@@ -305,7 +314,7 @@ parseargs(char *zsh_name, char **argv, char **runscript, char **cmdptr,
     pparams = x = (char **) zshcalloc((countlinknodes(paramlist) + 1) * sizeof(char *));
 
     while ((*x++ = (char *)getlinknode(paramlist)));
-    free(paramlist);
+    zfree(paramlist, sizeof(struct linklist));
     argzero = ztrdup(argzero);
     posixzero = ztrdup(posixzero);
 }
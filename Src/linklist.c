@@ -117,7 +117,7 @@ znewlinklist(void)
 {
     LinkList list;
 
-    list = (LinkList) zalloc(sizeof *list);
+    list = (LinkList) zslaballoc(sizeof *list, MEMTAG_LINKNODE);
     if (!list)
 	return NULL;
     list->list.first = NULL;
@@ -153,7 +153,7 @@ zinsertlinknode(LinkList list, LinkNode node, void *dat)
     LinkNode tmp, new;
 
     tmp = node->next;
-    node->next = new = (LinkNode) zalloc(sizeof *tmp);
+    node->next = new = (LinkNode) zslaballoc(sizeof *tmp, MEMTAG_LINKNODE);
     if (!new)
 	return NULL;
     new->prev = node;
@@ -55,6 +55,10 @@
 	it will all be freed when the pool is destroyed.  In fact,
 	attempting to free this memory may result in a core dump.
 
+	Small permanent objects may also be allocated with zslaballoc(),
+	see the comment above that function.  Such memory must only be
+	freed with zfree()/zsfree() and resized with zrealloc().
+
 	If possible, the heaps are allocated using mmap() so that the
 	(*real*) heap isn't filled up with empty zsh heaps. If mmap()
 	is not available and zsh's own allocator is used, we use a simple trick
@@ -133,6 +137,51 @@ static Heap heaps;
 
 static Heap fheap;
 
+/*
+ * Arenas of the standard size that are no longer needed are kept in a
+ * pool rather than given back to the system at once, since anything
+ * that keeps pushing and popping heaps (every function call, every
+ * command substitution) would otherwise acquire and release the same
+ * memory over and over.  The pool holds at most HEAPPOOL_MAX arenas.
+ * When the shell is about to become idle, trimheappool() gives back
+ * those that would not have been needed at the busiest point since the
+ * last trim.
+ */
+
+#ifdef ZSH_VALGRIND
+#define HEAPPOOL_MAX 0
+#else
+#define HEAPPOOL_MAX 32
+#endif
+
+static Heap heappool;
+static int heappoolct;
+
+/* size of standard arenas, once one has been allocated */
+
+static size_t heapstdsize;
+
+/* standard arenas in use, now and at most since the last trim */
+
+static int heapsinuse, heapspeak;
+
+/* statistics, shown by the mem builtin */
+
+#define HEAPSTAT_LEVELS 16
+
+static struct {
+    zlong hits;			/* standard arenas taken from the pool      */
+    zlong misses;		/* ... and from the system                  */
+    zlong large;		/* larger arenas                            */
+    zlong trimmed;		/* arenas given back by trimheappool()      */
+} heappoolstats;
+
+/* pushheap() depth, size of all arenas in use and its peak per depth */
+
+static int heaplevel;
+static size_t heapbytes;
+static size_t heappeak[HEAPSTAT_LEVELS];
+
 /**/
 #ifdef ZSH_HEAP_DEBUG
 /*
@@ -231,11 +280,7 @@ old_heaps(Heap old)
 		    "freed in old_heaps().\n", h->heap_id);
 	}
 #endif
-#ifdef USE_MMAP
-	munmap((void *) h, h->size);
-#else
-	zfree(h, HEAPSIZE);
-#endif
+	heapfree(h);
 #ifdef ZSH_VALGRIND
 	VALGRIND_DESTROY_MEMPOOL((char *)h);
 #endif
@@ -298,6 +343,7 @@ pushheap(void)
 #if defined(ZSH_MEM) && defined(ZSH_MEM_DEBUG)
     h_push++;
 #endif
+    heaplevel++;
 
     for (h = heaps; h; h = h->next) {
 	DPUTS(!h->used && h->next, "BUG: empty heap");
@@ -418,11 +464,7 @@ freeheap(void)
 		fheap = hl = h;
 		break;
 	    }
-#ifdef USE_MMAP
-	    munmap((void *) h, h->size);
-#else
-	    zfree(h, HEAPSIZE);
-#endif
+	    heapfree(h);
 #ifdef ZSH_VALGRIND
 	    VALGRIND_DESTROY_MEMPOOL((char *)h);
 #endif
@@ -450,6 +492,7 @@ popheap(void)
 #if defined(ZSH_MEM) && defined(ZSH_MEM_DEBUG)
     h_pop++;
 #endif
+    heaplevel--;
 
     fheap = NULL;
     for (h = heaps; h; h = hn) {
@@ -499,11 +542,7 @@ popheap(void)
 		h->next = NULL;
 	    } else if (hl == h)	/* This is the last arena of all */
 		hl = NULL;
-#ifdef USE_MMAP
-	    munmap((void *) h, h->size);
-#else
-	    zfree(h, HEAPSIZE);
-#endif
+	    heapfree(h);
 #ifdef ZSH_VALGRIND
 	    VALGRIND_DESTROY_MEMPOOL((char *)h);
 #endif
@@ -554,6 +593,145 @@ mmap_heap_alloc(size_t *n)
 }
 #endif
 
+/* Note that an arena of size n was acquired (dir 1) or released (-1) */
+
+/**/
+static void
+heapaccount(size_t n, int dir)
+{
+    int lev = heaplevel < HEAPSTAT_LEVELS ? heaplevel : HEAPSTAT_LEVELS - 1;
+
+    if (dir > 0) {
+	heapbytes += n;
+	if (heapbytes > heappeak[lev])
+	    heappeak[lev] = heapbytes;
+	if (n == heapstdsize && ++heapsinuse > heapspeak)
+	    heapspeak = heapsinuse;
+    } else {
+	heapbytes -= n;
+	if (n == heapstdsize)
+	    heapsinuse--;
+    }
+}
+
+/* Give an arena back to the system */
+
+/**/
+static void
+heaprelease(Heap h)
+{
+#ifdef USE_MMAP
+    munmap((void *) h, h->size);
+#else
+    zfree(h, HEAPSIZE);
+#endif
+}
+
+/* Get an arena of at least *n bytes, *n is set to its real size */
+
+/**/
+static Heap
+heapalloc(size_t *n)
+{
+    Heap h;
+    int std = (*n == HEAPSIZE);
+
+    if (std && heappool) {
+	h = heappool;
+	heappool = h->next;
+	heappoolct--;
+	heappoolstats.hits++;
+	*n = h->size;
+    } else {
+#ifdef USE_MMAP
+	h = mmap_heap_alloc(n);
+#else
+	h = (Heap) zalloc(*n);
+#endif
+	if (std) {
+	    heapstdsize = *n;
+	    heappoolstats.misses++;
+	} else
+	    heappoolstats.large++;
+    }
+    heapaccount(*n, 1);
+    return h;
+}
+
+/* Finish with an arena, keeping it in the pool if there's room */
+
+/**/
+static void
+heapfree(Heap h)
+{
+    heapaccount(h->size, -1);
+    if (h->size == heapstdsize && heappoolct < HEAPPOOL_MAX) {
+	h->next = heappool;
+	heappool = h;
+	heappoolct++;
+    } else
+	heaprelease(h);
+}
+
+/* Give back pooled arenas that were not recently needed */
+
+/**/
+mod_export void
+trimheappool(void)
+{
+    int keep = heapspeak - heapsinuse;
+    Heap h;
+
+    queue_signals();
+    while (heappoolct > keep) {
+	h = heappool;
+	heappool = h->next;
+	heappoolct--;
+	heappoolstats.trimmed++;
+	heaprelease(h);
+    }
+    heapspeak = heapsinuse;
+    unqueue_signals();
+}
+
+/**/
+#ifdef ZSH_MEM_DEBUG
+
+/**/
+static void
+printheapstats(Options ops)
+{
+    int i;
+
+    if (OPT_ISSET(ops,'v')) {
+	printf("\nThe number of standard heap arenas that were taken from\n");
+	printf("the pool of unused arenas, and that had to be allocated,\n");
+	printf("the number of larger arenas, the number of arenas given\n");
+	printf("back when the pool was trimmed, and the current pool size.\n");
+    }
+    printf("\nheap arenas:\n\npool hits %ld\tmisses %ld\tlarge %ld\t"
+	   "trimmed %ld\tpooled %d\n",
+	   (long) heappoolstats.hits, (long) heappoolstats.misses,
+	   (long) heappoolstats.large, (long) heappoolstats.trimmed,
+	   heappoolct);
+    if (heappoolstats.hits + heappoolstats.misses)
+	printf("hit rate %.1f%%\n", 100.0 * heappoolstats.hits /
+	       (heappoolstats.hits + heappoolstats.misses));
+
+    if (OPT_ISSET(ops,'v')) {
+	printf("\nFor each depth of pushheap() calls the largest total\n");
+	printf("size of the heap arenas in use at that depth.\n");
+    }
+    printf("\nlevel\tpeak\n");
+    for (i = 0; i < HEAPSTAT_LEVELS; i++)
+	if (heappeak[i])
+	    printf("%d%s\t%ld\n", i, i == HEAPSTAT_LEVELS - 1 ? "+" : "",
+		   (long) heappeak[i]);
+}
+
+/**/
+#endif
+
 /* check whether a pointer is within a memory pool */
 
 /**/
@@ -633,11 +811,7 @@ zhalloc(size_t size)
 
 	n = HEAP_ARENA_SIZE > size ? HEAPSIZE : size + sizeof(*h);
 
-#ifdef USE_MMAP
-	h = mmap_heap_alloc(&n);
-#else
-	h = (Heap) zalloc(n);
-#endif
+	h = heapalloc(&n);
 
 #if defined(ZSH_MEM) && !defined(USE_MMAP)
 	if (called)
@@ -781,11 +955,7 @@ hrealloc(char *p, size_t old, size_t new)
 	    else
 		heaps = h->next;
 	    fheap = NULL;
-#ifdef USE_MMAP
-	    munmap((void *) h, h->size);
-#else
-	    zfree(h, HEAPSIZE);
-#endif
+	    heapfree(h);
 #ifdef ZSH_VALGRIND
 	    VALGRIND_DESTROY_MEMPOOL((char *)h);
 #endif
@@ -815,13 +985,15 @@ hrealloc(char *p, size_t old, size_t new)
 		 * a mmap'd segment be extended, so simply allocate
 		 * a new one and copy.
 		 */
-		hnew = mmap_heap_alloc(&n);
+		hnew = heapalloc(&n);
 		/* Copy the entire heap, header (with next pointer) included */
 		memcpy(hnew, h, h->size);
-		munmap((void *)h, h->size);
+		heapfree(h);
 	    }
 #else
+	    heapaccount(h->size, -1);
 	    hnew = (Heap) realloc(h, n);
+	    heapaccount(n, 1);
 #endif
 #ifdef ZSH_VALGRIND
 	    VALGRIND_MEMPOOL_FREE((char *)h, p);
@@ -939,6 +1111,172 @@ memory_validate(Heapid heap_id)
 /**/
 #endif
 
+/*
+ * Small permanent objects that are created and deleted all the time
+ * (parameters, hash table nodes, linked lists) can be allocated with
+ * zslaballoc() instead of zalloc().  Their memory is carved from
+ * chunks of a region that is mapped for this purpose.  Each chunk holds
+ * cells of a single size for a single MEMTAG_* category, so zfree()
+ * can tell from an address alone whether it belongs to a chunk and
+ * onto which free list it goes, and the counts kept for each category
+ * (shown by the mem builtin) are exact.  Cells are only ever reused for
+ * the same size and category, they are not given back to the system.
+ *
+ * Memory from zslaballoc() must only be released with zfree() or
+ * zsfree() and resized with zrealloc(), never passed to free() or
+ * realloc().  If the region can't be mapped, or is full, or the object
+ * is too large, zslaballoc() is the same as zalloc().
+ */
+
+#if defined(USE_MMAP) && !defined(ZSH_MEM) && !defined(ZSH_VALGRIND) && \
+    !defined(__SANITIZE_ADDRESS__)
+# define USE_SLAB 1
+#endif
+
+#ifdef USE_SLAB
+
+#define SLAB_CHUNK	16384		/* size of a chunk */
+#define SLAB_MAXREGION	0x4000000	/* at most 64MB ... */
+#define SLAB_REGION	(sizeof(void *) > 4 ? SLAB_MAXREGION : SLAB_MAXREGION / 4)
+#define SLAB_QUANTUM	16		/* cell sizes are multiples of this */
+#define SLAB_CLASSES	8		/* ... up to this many times */
+
+/* free cells are linked through their first word */
+
+struct slabcell {
+    struct slabcell *next;
+};
+
+/* cells of one size for one category */
+
+struct slablist {
+    struct slabcell *free;	/* cells that were freed                   */
+    char *next, *end;		/* the rest of the newest chunk            */
+};
+
+static struct slablist slablists[SLAB_CLASSES * MEMTAG_COUNT];
+
+#define SLABLIST(C, T)	((C) * MEMTAG_COUNT + (T))
+#define SLABTAG(L)	((L) % MEMTAG_COUNT)
+#define SLABCELL(L)	((L) / MEMTAG_COUNT * SLAB_QUANTUM + SLAB_QUANTUM)
+
+/*
+ * The region is mapped from slabbase to slabend; chunks up to slabtop
+ * are in use, for each of them slabchunks has the index of its list.
+ */
+
+static char *slabbase, *slabtop, *slabend;
+static unsigned char slabchunks[SLAB_MAXREGION / SLAB_CHUNK];
+static int slabfailed;
+
+#define ISSLAB(P)	((char *) (P) >= slabbase && (char *) (P) < slabtop)
+#define SLABOF(P)	slabchunks[((char *) (P) - slabbase) / SLAB_CHUNK]
+
+/* counts for each category */
+
+static struct {
+    zlong allocs;		/* cells allocated                         */
+    zlong frees;		/* cells freed                             */
+    zlong bytes;		/* bytes in cells now in use               */
+} memtagstats[MEMTAG_COUNT];
+
+/* Start a new chunk for slab list l, return 0 if there is no room */
+
+static int
+slabgrow(int l)
+{
+    size_t cell = SLABCELL(l);
+
+    if (!slabbase) {
+	char *p;
+
+	if (slabfailed)
+	    return 0;
+	/* Only reserve the addresses, chunks are enabled as needed */
+	p = (char *) mmap(NULL, SLAB_REGION, PROT_NONE, MMAP_FLAGS, -1, 0);
+	if (p == (char *) -1) {
+	    slabfailed = 1;
+	    return 0;
+	}
+	slabbase = slabtop = p;
+	slabend = p + SLAB_REGION;
+    }
+    if (slabtop == slabend ||
+	mprotect(slabtop, SLAB_CHUNK, PROT_READ | PROT_WRITE))
+	return 0;
+    SLABOF(slabtop) = l;
+    slablists[l].next = slabtop;
+    slablists[l].end = slabtop + SLAB_CHUNK / cell * cell;
+    slabtop += SLAB_CHUNK;
+    return 1;
+}
+
+/* Return a cell to its free list */
+
+static void
+slabfree(void *p)
+{
+    int l = SLABOF(p);
+    struct slabcell *c = (struct slabcell *) p;
+
+    queue_signals();
+#ifdef ZSH_MEM_DEBUG
+    memset(p, 0xff, SLABCELL(l));
+#endif
+    c->next = slablists[l].free;
+    slablists[l].free = c;
+    memtagstats[SLABTAG(l)].frees++;
+    memtagstats[SLABTAG(l)].bytes -= SLABCELL(l);
+    unqueue_signals();
+}
+
+#endif /* USE_SLAB */
+
+/* allocate permanent memory for a small object of category tag */
+
+/**/
+mod_export void *
+zslaballoc(size_t size, int tag)
+{
+#ifdef USE_SLAB
+    struct slablist *sl;
+    struct slabcell *c;
+    int l;
+
+    if (!size || size > SLAB_CLASSES * SLAB_QUANTUM)
+	return zalloc(size);
+    l = SLABLIST((size - 1) / SLAB_QUANTUM, tag);
+    sl = slablists + l;
+    queue_signals();
+    if ((c = sl->free))
+	sl->free = c->next;
+    else if (sl->next != sl->end || slabgrow(l)) {
+	c = (struct slabcell *) sl->next;
+	sl->next += SLABCELL(l);
+    } else {
+	unqueue_signals();
+	return zalloc(size);
+    }
+    memtagstats[tag].allocs++;
+    memtagstats[tag].bytes += SLABCELL(l);
+    unqueue_signals();
+
+    return c;
+#else
+    return zalloc(size);
+#endif
+}
+
+/**/
+mod_export void *
+zslabcalloc(size_t size, int tag)
+{
+    void *ptr = zslaballoc(size, tag);
+
+    memset(ptr, 0, size ? size : 1);
+    return ptr;
+}
+
 /* allocate memory from the current memory pool and clear it */
 
 /**/
@@ -993,6 +1331,19 @@ zshcalloc(size_t size)
 mod_export void *
 zrealloc(void *ptr, size_t size)
 {
+#ifdef USE_SLAB
+    if (ISSLAB(ptr)) {
+	void *new = NULL;
+	size_t old = SLABCELL(SLABOF(ptr));
+
+	if (size) {
+	    new = zalloc(size);
+	    memcpy(new, ptr, old < size ? old : size);
+	}
+	slabfree(ptr);
+	return new;
+    }
+#endif
     queue_signals();
     if (ptr) {
 	if (size) {
@@ -1871,6 +2222,7 @@ bin_mem(char *name, char **argv, Options ops, int func)
 		   (long)i * H_ISIZE * h_m[i]);
     if (h_m[1024])
 	printf("big\t%d\n", h_m[1024]);
+    printheapstats(ops);
 
     unqueue_signals();
     return 0;
@@ -1885,6 +2237,12 @@ bin_mem(char *name, char **argv, Options ops, int func)
 mod_export void
 zfree(void *p, UNUSED(int sz))
 {
+#ifdef USE_SLAB
+    if (ISSLAB(p)) {
+	slabfree(p);
+	return;
+    }
+#endif
     free(p);
 }
 
@@ -1892,8 +2250,78 @@ zfree(void *p, UNUSED(int sz))
 mod_export void
 zsfree(char *p)
 {
+#ifdef USE_SLAB
+    if (ISSLAB(p)) {
+	slabfree(p);
+	return;
+    }
+#endif
     free(p);
 }
 
+#ifdef ZSH_MEM_DEBUG
+
+/**/
+int
+bin_mem(UNUSED(char *name), UNUSED(char **argv), Options ops, UNUSED(int func))
+{
+#ifdef USE_SLAB
+    static char *tagnames[MEMTAG_COUNT] = {
+	"param", "hashnode", "assoc", "linknode"
+    };
+    int chunks[SLAB_CLASSES * MEMTAG_COUNT];
+    int i, l, n;
+    struct slabcell *c;
+
+    queue_signals();
+    if (OPT_ISSET(ops,'v')) {
+	printf("The size of the region reserved for small objects, and\n");
+	printf("how much of it is in use.\n\n");
+    }
+    printf("slab region %ld\tin use %ld\tchunk size %d\n",
+	   slabbase ? (long) (slabend - slabbase) : 0L,
+	   (long) (slabtop - slabbase), SLAB_CHUNK);
+
+    if (OPT_ISSET(ops,'v')) {
+	printf("\nFor each category of small objects the number of objects\n");
+	printf("that were allocated and freed, the number currently in use\n");
+	printf("and the number of bytes they take up.\n");
+    }
+    printf("\ncategory\tallocs\tfrees\tlive\tbytes\n");
+    for (i = 0; i < MEMTAG_COUNT; i++)
+	printf("%s\t%s%ld\t%ld\t%ld\t%ld\n", tagnames[i],
+	       strlen(tagnames[i]) < 8 ? "\t" : "",
+	       (long) memtagstats[i].allocs, (long) memtagstats[i].frees,
+	       (long) (memtagstats[i].allocs - memtagstats[i].frees),
+	       (long) memtagstats[i].bytes);
+
+    if (OPT_ISSET(ops,'v')) {
+	printf("\nFor each cell size used by a category the number of\n");
+	printf("chunks holding such cells and the number of free cells.\n");
+    }
+    printf("\nsize\tcategory\tchunks\tfree\n");
+    memset(chunks, 0, sizeof(chunks));
+    for (i = 0; i < (slabtop - slabbase) / SLAB_CHUNK; i++)
+	chunks[slabchunks[i]]++;
+    for (l = 0; l < SLAB_CLASSES * MEMTAG_COUNT; l++) {
+	if (!chunks[l])
+	    continue;
+	for (n = 0, c = slablists[l].free; c; c = c->next)
+	    n++;
+	n += (slablists[l].end - slablists[l].next) / SLABCELL(l);
+	printf("%d\t%s\t%s%d\t%d\n", (int) SLABCELL(l),
+	       tagnames[SLABTAG(l)], strlen(tagnames[SLABTAG(l)]) < 8 ? "\t" : "",
+	       chunks[l], n);
+    }
+    unqueue_signals();
+#else
+    printf("small objects are allocated with malloc()\n");
+#endif
+    printheapstats(ops);
+    return 0;
+}
+
+#endif
+
 /**/
 #endif
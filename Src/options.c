@@ -151,7 +151,9 @@ static struct optname optns[] = {
 {{NULL, "hashexecutablesonly", 0},                       HASHEXECUTABLESONLY},
 {{NULL, "hashlistall",	      OPT_ALL},			 HASHLISTALL},
 {{NULL, "histallowclobber",   0},			 HISTALLOWCLOBBER},
+{{NULL, "histatomicappend",   0},			 HISTATOMICAPPEND},
 {{NULL, "histbeep",	      OPT_ALL},			 HISTBEEP},
+{{NULL, "histbgrewrite",      0},			 HISTBGREWRITE},
 {{NULL, "histexpiredupsfirst",0},			 HISTEXPIREDUPSFIRST},
 {{NULL, "histfcntllock",      0},			 HISTFCNTLLOCK},
 {{NULL, "histfindnodups",     0},			 HISTFINDNODUPS},
@@ -166,6 +168,7 @@ static struct optname optns[] = {
 {{NULL, "histsavebycopy",     OPT_ALL},			 HISTSAVEBYCOPY},
 {{NULL, "histsavenodups",     0},			 HISTSAVENODUPS},
 {{NULL, "histverify",	      0},			 HISTVERIFY},
+{{NULL, "histwatchfile",      0},			 HISTWATCHFILE},
 {{NULL, "hup",		      OPT_EMULATE|OPT_ZSH},	 HUP},
 {{NULL, "ignorebraces",	      OPT_EMULATE|OPT_SH},	 IGNOREBRACES},
 {{NULL, "ignoreclosebraces",  OPT_EMULATE},		 IGNORECLOSEBRACES},
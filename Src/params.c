@@ -218,6 +218,8 @@ static const struct gsu_integer euid_gsu =
 { euidgetfn, euidsetfn, stdunsetfn };
 static const struct gsu_integer ttyidle_gsu =
 { ttyidlegetfn, nullintsetfn, stdunsetfn };
+static const struct gsu_integer histlockwait_gsu =
+{ histlockwaitgetfn, nullintsetfn, stdunsetfn };
 
 static const struct gsu_scalar argzero_gsu =
 { argzerogetfn, argzerosetfn, nullunsetfn };
@@ -305,6 +307,7 @@ IPDEF1("SECONDS", intseconds_gsu, 0),
 IPDEF1("UID", uid_gsu, PM_DONTIMPORT | PM_RESTRICTED),
 IPDEF1("EUID", euid_gsu, PM_DONTIMPORT | PM_RESTRICTED),
 IPDEF1("TTYIDLE", ttyidle_gsu, PM_READONLY_SPECIAL),
+IPDEF1("HISTLOCKWAIT", histlockwait_gsu, PM_READONLY_SPECIAL),
 
 #define IPDEF2(A,B,C) {{NULL,A,PM_SCALAR|PM_SPECIAL|C},BR(NULL),GSU(B),0,0,NULL,NULL,NULL,0}
 IPDEF2("USERNAME", username_gsu, PM_DONTIMPORT|PM_RESTRICTED),
@@ -496,9 +499,9 @@ newparamtable(int size, char const *name)
     HashTable ht;
     if (!size)
 	size = 17;
-    ht = newhashtable(size, name, NULL);
+    ht = newopenhashtable(size, name, NULL);
 
-    ht->hash        = hasher;
+    ht->hash        = wordhasher;
     ht->emptytable  = emptyhashtable;
     ht->filltable   = NULL;
     ht->cmpnodes    = strcmp;
@@ -540,6 +543,231 @@ getparamnode(HashTable ht, const char *nam)
     return hn;
 }
 
+/*
+ * Plain associative arrays, those that are not special and use
+ * hashsetfn(), keep their elements in a compact form.  Each node of
+ * the table holds only the key, the flags and the value instead of a
+ * full struct param.  Lookups return a struct param on the heap that
+ * stands in for the element; setting or unsetting it writes through
+ * to the node.  Scans of the table pass a view in storage belonging
+ * to the scan, filled in afresh for each element.
+ */
+
+struct assocnode {
+    struct hashnode node;
+    char *val;			/* value of the element, or NULL */
+};
+
+typedef struct assocnode *AssocNode;
+
+static const struct gsu_scalar assocelem_gsu =
+{ strgetfn, assocelemsetfn, assocelemunsetfn };
+
+/* Fill in v as a view of node an of the compact table ht */
+
+static Param
+fillassocview(HashView v, HashTable ht, AssocNode an)
+{
+    memset(v, 0, sizeof(*v));
+    v->pm.node.nam = an->node.nam;
+    v->pm.node.flags = an->node.flags;
+    v->pm.u.str = an->val;
+    v->pm.gsu.s = &assocelem_gsu;
+    v->ht = ht;
+    return &v->pm;
+}
+
+/* Return a view of node an on the heap, safe to use after it's freed */
+
+static Param
+heapassocview(HashTable ht, AssocNode an)
+{
+    HashView v = (HashView) zhalloc(sizeof(*v));
+
+    fillassocview(v, ht, an);
+    v->pm.node.nam = dupstring(an->node.nam);
+    return &v->pm;
+}
+
+/**/
+static void
+freeassocnode(HashNode hn)
+{
+    AssocNode an = (AssocNode) hn;
+
+    zsfree(an->node.nam);
+    zsfree(an->val);
+    zfree(an, sizeof(*an));
+}
+
+/**/
+static HashNode
+getassocnode(HashTable ht, const char *nam)
+{
+    AssocNode an = (AssocNode) gethashnode2(ht, nam);
+
+    return an ? &heapassocview(ht, an)->node : NULL;
+}
+
+/* Add a parameter as an element; the node takes over its value */
+
+/**/
+static void
+addassocnode(HashTable ht, char *nam, void *nodeptr)
+{
+    Param pm = (Param) nodeptr;
+    AssocNode an = (AssocNode) zslabcalloc(sizeof(*an), MEMTAG_ASSOC);
+    HashNode old;
+
+    an->node.flags = pm->node.flags;
+    if (pm->gsu.s == &assocelem_gsu) {
+	/* a view doesn't own its value */
+	an->val = ztrdup(pm->u.str);
+    } else {
+	an->val = pm->u.str;
+	zfree(pm, sizeof(*pm));
+    }
+    if ((old = addhashnode2(ht, nam, an)))
+	freeassocnode(old);
+}
+
+/* The node removed is freed at once, the caller gets a copy */
+
+/**/
+static HashNode
+removeassocnode(HashTable ht, const char *nam)
+{
+    AssocNode an = (AssocNode) removehashnode(ht, nam);
+    Param pm;
+
+    if (!an)
+	return NULL;
+    pm = heapassocview(ht, an);
+    pm->u.str = an->val ? dupstring(an->val) : NULL;
+    freeassocnode(&an->node);
+    return &pm->node;
+}
+
+/* Views live on the heap, so there is nothing to free */
+
+/**/
+static void
+freeassocview(UNUSED(HashNode hn))
+{
+}
+
+/**/
+static void
+emptyassoctable(HashTable ht)
+{
+    int i;
+
+    for (i = 0; i < ht->hsize; i++)
+	if (ht->nodes[i]) {
+	    freeassocnode(ht->nodes[i]);
+	    ht->nodes[i] = NULL;
+	}
+    emptyhashtable(ht);
+}
+
+/**/
+static HashNode
+viewassocnode(HashTable ht, HashNode hn, HashView v)
+{
+    return &fillassocview(v, ht, (AssocNode) hn)->node;
+}
+
+/**/
+static void
+assocelemsetfn(Param pm, char *x)
+{
+    HashTable ht = ((HashView) pm)->ht;
+    AssocNode an = (AssocNode) gethashnode2(ht, pm->node.nam);
+
+    if (an)
+	zsfree(an->val);
+    else if (x) {
+	/* the element was removed behind our back */
+	an = (AssocNode) zslabcalloc(sizeof(*an), MEMTAG_ASSOC);
+	addhashnode2(ht, ztrdup(pm->node.nam), an);
+    }
+    if (an) {
+	an->node.flags = pm->node.flags;
+	an->val = x;
+    }
+    pm->u.str = x;
+}
+
+/**/
+static void
+assocelemunsetfn(Param pm, int exp)
+{
+    AssocNode an;
+
+    stdunsetfn(pm, exp);
+    if ((an = (AssocNode) gethashnode2(((HashView) pm)->ht, pm->node.nam)))
+	an->node.flags = pm->node.flags;
+}
+
+/*
+ * createparam() for an element of a compact table: return NULL if
+ * the element is set already, else a view of a new or reused node.
+ */
+
+/**/
+static Param
+createassocelem(HashTable ht, char *name, int flags)
+{
+    AssocNode an = (AssocNode) gethashnode2(ht, name);
+
+    if (an && !(an->node.flags & PM_UNSET))
+	return NULL;
+    if (!an) {
+	an = (AssocNode) zslabcalloc(sizeof(*an), MEMTAG_ASSOC);
+	addhashnode2(ht, ztrdup(name), an);
+    }
+    an->node.flags = flags & ~PM_LOCAL;
+    return heapassocview(ht, an);
+}
+
+/*
+ * Switch the ordinary parameter table ht of a plain association to the
+ * compact form, unless it holds anything but plain scalar elements.
+ * This is done in place as callers may hold on to the table.
+ */
+
+/**/
+static void
+compactassoc(HashTable ht)
+{
+    Param pm;
+    AssocNode an;
+    int i;
+
+    for (i = 0; i < ht->hsize; i++)
+	if ((pm = (Param) ht->nodes[i]) &&
+	    (PM_TYPE(pm->node.flags) != PM_SCALAR ||
+	     pm->gsu.s != &stdscalar_gsu || pm->old || pm->ename ||
+	     (pm->node.flags & PM_SPECIAL)))
+	    return;
+    for (i = 0; i < ht->hsize; i++)
+	if ((pm = (Param) ht->nodes[i])) {
+	    an = (AssocNode) zslabcalloc(sizeof(*an), MEMTAG_ASSOC);
+	    an->node.flags = pm->node.flags;
+	    an->val = pm->u.str;
+	    /* the same key, so this stays in slot i */
+	    addhashnode2(ht, pm->node.nam, an);
+	    zfree(pm, sizeof(*pm));
+	}
+    ht->emptytable  = emptyassoctable;
+    ht->addnode     = addassocnode;
+    ht->getnode     = getassocnode;
+    ht->getnode2    = getassocnode;
+    ht->removenode  = removeassocnode;
+    ht->freenode    = freeassocview;
+    ht->viewnode    = viewassocnode;
+}
+
 /* Copy a parameter hash table */
 
 static HashTable outtable;
@@ -550,10 +778,10 @@ scancopyparams(HashNode hn, UNUSED(int flags))
 {
     /* Going into a real parameter, so always use permanent storage */
     Param pm = (Param)hn;
-    Param tpm = (Param) zshcalloc(sizeof *tpm);
+    Param tpm = (Param) zslabcalloc(sizeof *tpm, MEMTAG_PARAM);
     tpm->node.nam = ztrdup(pm->node.nam);
     copyparam(tpm, pm, 0);
-    addhashnode(outtable, tpm->node.nam, tpm);
+    outtable->addnode(outtable, tpm->node.nam, tpm);
 }
 
 /**/
@@ -563,6 +791,8 @@ copyparamtable(HashTable ht, char *name)
     HashTable nht = 0;
     if (ht) {
 	nht = newparamtable(ht->hsize, name);
+	if (ht->getnode == getassocnode)
+	    compactassoc(nht);
 	outtable = nht;
 	scanhashtable(ht, 0, 0, 0, scancopyparams, 0);
 	outtable = NULL;
@@ -648,6 +878,38 @@ scanparamvals(HashNode hn, int flags)
     foundparam = NULL;
 }
 
+/*
+ * For the scan function of a special hash table.  If the scan is
+ * for the values (SCANPM_MATCHVAL) or keys (SCANPM_MATCHKEY)
+ * matching a subscript pattern, return the pattern, so that entries
+ * which don't match can be skipped without making nodes for them.
+ * Anything passed on is still checked against the pattern.
+ */
+
+/**/
+mod_export Patprog
+scanparampattern(ScanFunc func, int flags)
+{
+    if (func == scanparamvals && (flags & (SCANPM_MATCHVAL|SCANPM_MATCHKEY)))
+	return scanprog;
+    return NULL;
+}
+
+/*
+ * Return 1 if a scan with func and flags has found all it needs,
+ * i.e. it only wants the first match of a subscript and has got it,
+ * so the scan function of a special hash can stop there.
+ */
+
+/**/
+mod_export int
+scanparamsdone(ScanFunc func, int flags)
+{
+    return (func == scanparamvals || func == scancountparams) &&
+	numparamvals && !(flags & SCANPM_MATCHMANY) &&
+	(flags & (SCANPM_MATCHVAL|SCANPM_MATCHKEY|SCANPM_KEYMATCH));
+}
+
 /**/
 char **
 paramvalarr(HashTable ht, int flags)
@@ -984,8 +1246,11 @@ createparam(char *name, int flags)
 {
     Param pm, oldpm;
 
-    if (paramtab != realparamtab)
+    if (paramtab != realparamtab) {
 	flags = (flags & ~PM_EXPORTED) | PM_HASHELEM;
+	if (paramtab->getnode == getassocnode && name != nulstring)
+	    return createassocelem(paramtab, name, flags);
+    }
 
     if (name != nulstring) {
 	oldpm = (Param) (paramtab == realparamtab ?
@@ -1022,7 +1287,7 @@ createparam(char *name, int flags)
 	    pm->base = pm->width = 0;
 	    oldpm = pm->old;
 	} else {
-	    pm = (Param) zshcalloc(sizeof *pm);
+	    pm = (Param) zslabcalloc(sizeof *pm, MEMTAG_PARAM);
 	    if ((pm->old = oldpm)) {
 		/*
 		 * needed to avoid freeing oldpm, but we do take it
@@ -1090,8 +1355,10 @@ createspecialhash(char *name, GetNodeFunc get, ScanTabFunc scan, int flags)
      * These semantics are similar to those of a normal parameter set
      * within a function without a local definition.
      */
-    if (pm->old)
+    if (pm->old) {
 	pm->level = locallevel;
+	scopeparam(pm);
+    }
     pm->gsu.h = (flags & PM_READONLY) ? &stdhash_gsu :
 	&nullsethash_gsu;
     pm->u.hash = ht = newhashtable(0, name, NULL);
@@ -1134,6 +1401,7 @@ copyparam(Param tpm, Param pm, int fakecopy)
     tpm->base = pm->base;
     tpm->width = pm->width;
     tpm->level = pm->level;
+    tpm->vsize = 0;
     if (!fakecopy) {
 	tpm->old = pm->old;
 	tpm->node.flags &= ~PM_SPECIAL;
@@ -2548,7 +2816,7 @@ assignstrvalue(Value v, char *val, int flags)
             int zlen, vlen, newsize;
 
             z = v->pm->gsu.s->getfn(v->pm);
-            zlen = strlen(z);
+            zlen = strvaluelen(v->pm, z);
 
 	    if ((v->flags & VALFLAG_INV) && unset(KSHARRAYS))
 		v->start--, v->end--;
@@ -2586,8 +2854,33 @@ assignstrvalue(Value v, char *val, int flags)
                characters following end index */
             newsize = v->start + vlen + (zlen - v->end);
 
-            /* Does new size differ? */
-            if (newsize != zlen || v->pm->gsu.s->setfn != strsetfn) {
+            if (v->start == zlen && v->end == zlen &&
+		z == v->pm->u.str && v->pm->gsu.s->setfn == strsetfn) {
+		Param pm = v->pm;
+		int size = pm->vsize ? pm->vsize : zlen + 1;
+
+		/*
+		 * Appending to an ordinary scalar: extend the value
+		 * where it is, keeping spare room at the end so that
+		 * building up a string piece by piece takes linear time.
+		 */
+		if (newsize + 1 > size) {
+		    size = newsize + 1;
+		    size += size / 2 + 16;
+		    pm->u.str = z = (char *) zrealloc(z, size);
+		}
+		strcpy(z + zlen, val);
+		pm->vlen = newsize;
+		pm->vsize = size;
+		/* Implement remainder of strsetfn */
+		if (!(pm->node.flags & PM_HASHELEM) &&
+		    ((pm->node.flags & PM_NAMEDDIR) ||
+		     isset(AUTONAMEDIRS))) {
+		    pm->node.flags |= PM_NAMEDDIR;
+		    adduserdir(pm->node.nam, z, 0, 0);
+		}
+	    } else if (newsize != zlen || v->pm->gsu.s->setfn != strsetfn) {
+		/* New size differs */
                 x = (char *) zalloc(newsize + 1);
                 strncpy(x, z, v->start);
                 strcpy(x + v->start, val);
@@ -2761,7 +3054,7 @@ setarrvalue(Value v, char **val)
 	char **const old = v->pm->gsu.a->getfn(v->pm);
 	char **new;
 	char **p, **q, **r; /* index variables */
-	const int pre_assignment_length = arrlen(old);
+	const int pre_assignment_length = arrvaluelen(v->pm, old);
 	int post_assignment_length;
 	int i;
 
@@ -2816,8 +3109,24 @@ setarrvalue(Value v, char **val)
                     pre_assignment_length > 0 &&
                     v->pm->gsu.a->setfn == arrsetfn)
             {
-                p = new = (char **) zrealloc(old, sizeof(char *)
-                                           * (post_assignment_length + 1));
+		/*
+		 * Keep spare room at the end of ordinary arrays, so
+		 * that a sequence of appends takes linear time.
+		 */
+		int grow = !(v->pm->node.flags & (PM_SPECIAL|PM_UNIQUE)) &&
+		    !v->pm->ename;
+		int size = v->pm->vsize;
+
+		if (!size || old != v->pm->u.arr)
+		    size = pre_assignment_length + 1;
+		if (post_assignment_length + 1 > size) {
+		    size = post_assignment_length + 1;
+		    if (grow)
+			size += size / 2 + 4;
+		    new = (char **) zrealloc(old, sizeof(char *) * size);
+		} else
+		    new = old;
+		p = new;
 
                 p += pre_assignment_length; /* after old elements */
 
@@ -2841,6 +3150,10 @@ setarrvalue(Value v, char **val)
 
                 v->pm->u.arr = NULL;
                 v->pm->gsu.a->setfn(v->pm, new);
+		if (grow) {
+		    v->pm->vlen = post_assignment_length;
+		    v->pm->vsize = size;
+		}
             } else {
                 p = new = (char **) zalloc(sizeof(char *)
                                            * (post_assignment_length + 1));
@@ -3108,7 +3421,7 @@ assignsparam(char *s, char *val, int flags)
 		return v->pm; /* avoid later setstrvalue() call */
 	    case PM_ARRAY:
 	    	if (unset(KSHARRAYS)) {
-		    v->start = arrlen(v->pm->gsu.a->getfn(v->pm));
+		    v->start = arrvaluelen(v->pm, v->pm->gsu.a->getfn(v->pm));
 		    v->end = v->start + 1;
 		} else {
 		    /* ksh appends scalar to first element */
@@ -3371,7 +3684,7 @@ assignaparam(char *s, char **val, int flags)
     if (flags & ASSPM_AUGMENT) {
     	if (v->start == 0 && v->end == -1) {
 	    if (PM_TYPE(v->pm->node.flags) & PM_ARRAY) {
-	    	v->start = arrlen(v->pm->gsu.a->getfn(v->pm));
+	    	v->start = arrvaluelen(v->pm, v->pm->gsu.a->getfn(v->pm));
 	    	v->end = v->start + 1;
 	    } else if (PM_TYPE(v->pm->node.flags) & PM_HASHED)
 	    	v->start = -1, v->end = 0;
@@ -3379,7 +3692,8 @@ assignaparam(char *s, char **val, int flags)
 	    if (v->end > 0)
 		v->start = v->end--;
 	    else if (PM_TYPE(v->pm->node.flags) & PM_ARRAY) {
-		v->end = arrlen(v->pm->gsu.a->getfn(v->pm)) + v->end;
+		v->end = arrvaluelen(v->pm, v->pm->gsu.a->getfn(v->pm)) +
+		    v->end;
 		v->start = v->end + 1;
 	    }
 	}
@@ -3796,6 +4110,7 @@ strsetfn(Param pm, char *x)
 {
     zsfree(pm->u.str);
     pm->u.str = x;
+    pm->vsize = 0;
     if (!(pm->node.flags & PM_HASHELEM) &&
 	((pm->node.flags & PM_NAMEDDIR) || isset(AUTONAMEDIRS))) {
 	pm->node.flags |= PM_NAMEDDIR;
@@ -3805,6 +4120,27 @@ strsetfn(Param pm, char *x)
      * `Implement remainder of strsetfn' block in assignstrvalue(). */
 }
 
+/*
+ * Return the length in bytes of str, the value of the scalar
+ * parameter pm.  As for arrays, the length of an ordinary scalar is
+ * remembered until it is next set.
+ */
+
+/**/
+mod_export int
+strvaluelen(Param pm, char *str)
+{
+    if (!pm || !str || str != pm->u.str ||
+	PM_TYPE(pm->node.flags) != PM_SCALAR ||
+	pm->gsu.s->setfn != strsetfn)
+	return strlen(str);
+    if (!pm->vsize) {
+	pm->vlen = strlen(str);
+	pm->vsize = pm->vlen + 1;
+    }
+    return pm->vlen;
+}
+
 /* Function to get value of an array parameter */
 
 static char *nullarray = NULL;
@@ -3824,6 +4160,7 @@ arrsetfn(Param pm, char **x)
 {
     if (pm->u.arr && pm->u.arr != x)
 	freearray(pm->u.arr);
+    pm->vsize = 0;
     if (pm->node.flags & PM_UNIQUE)
 	uniqarray(x);
     pm->u.arr = x;
@@ -3834,6 +4171,26 @@ arrsetfn(Param pm, char **x)
      * setarrvalue(). */
 }
 
+/*
+ * Return the length of arr, the value of the array parameter pm.
+ * For ordinary arrays the length is remembered, so it is only
+ * counted once after each assignment.
+ */
+
+/**/
+mod_export int
+arrvaluelen(Param pm, char **arr)
+{
+    if (!pm || arr != pm->u.arr || PM_TYPE(pm->node.flags) != PM_ARRAY ||
+	pm->gsu.a->setfn != arrsetfn)
+	return arrlen(arr);
+    if (!pm->vsize && arr) {
+	pm->vlen = arrlen(arr);
+	pm->vsize = pm->vlen + 1;
+    }
+    return arr ? pm->vlen : 0;
+}
+
 /* Function to get value of an association parameter */
 
 /**/
@@ -3851,6 +4208,8 @@ hashsetfn(Param pm, HashTable x)
 {
     if (pm->u.hash && pm->u.hash != x)
 	deleteparamtable(pm->u.hash);
+    if (x && x->getnode == getparamnode && !(pm->node.flags & PM_SPECIAL))
+	compactassoc(x);
     pm->u.hash = x;
 }
 
@@ -3893,6 +4252,9 @@ arrhashsetfn(Param pm, char **val, int flags)
     }
     if (alen && (!(flags & ASSPM_AUGMENT) || !paramtab)) {
 	ht = paramtab = newparamtable(17, pm->node.nam);
+	/* saves converting the elements in hashsetfn() */
+	if (pm->gsu.h->setfn == hashsetfn && !(pm->node.flags & PM_SPECIAL))
+	    compactassoc(ht);
     }
     for (aptr = val; *aptr; ) {
 	int eltflags = 0;
@@ -4530,6 +4892,15 @@ ttyidlegetfn(UNUSED(Param pm))
     return time(NULL) - ttystat.st_atime;
 }
 
+/* Function to get value for special parameter `HISTLOCKWAIT' */
+
+/**/
+zlong
+histlockwaitgetfn(UNUSED(Param pm))
+{
+    return histlockwait / 1000;
+}
+
 /* Function to get value for special parameter `IFS' */
 
 /**/
@@ -5569,6 +5940,127 @@ startparamscope(void)
     locallevel++;
 }
 
+/*
+ * For each locallevel, a table of the names of the parameters made
+ * local at that level, so that endparamscope() only needs to look at
+ * those rather than at every parameter in the shell.  A name is only
+ * noted once however often it is made local again, so a loop that
+ * keeps recreating a local doesn't make the table grow.  Anything
+ * that sets the level of a parameter in the parameter table to more
+ * than zero must call scopeparam() afterwards.  The tables are kept
+ * for reuse when the scope ends unless they have grown large.
+ */
+
+static HashTable *scopeparams;
+static int scopeparamsz;
+
+#define SCOPEPARAMS_SIZE 17
+
+/**/
+static void
+freescopenode(HashNode hn)
+{
+    zsfree(hn->nam);
+    zfree(hn, sizeof(struct hashnode));
+}
+
+/* Note that pm is local to pm->level */
+
+/**/
+mod_export void
+scopeparam(Param pm)
+{
+    int lev = pm->level;
+    HashTable ht;
+
+    if (lev <= 0 || paramtab != realparamtab)
+	return;
+    if (lev >= scopeparamsz) {
+	int n = scopeparamsz ? scopeparamsz : 16;
+
+	while (n <= lev)
+	    n *= 2;
+	scopeparams = (HashTable *) zrealloc(scopeparams,
+					     n * sizeof(HashTable));
+	memset(scopeparams + scopeparamsz, 0,
+	       (n - scopeparamsz) * sizeof(HashTable));
+	scopeparamsz = n;
+    }
+    if (!(ht = scopeparams[lev])) {
+	ht = scopeparams[lev] = newhashtable(SCOPEPARAMS_SIZE,
+					     "scopeparams", NULL);
+	ht->hash        = hasher;
+	ht->emptytable  = emptyhashtable;
+	ht->filltable   = NULL;
+	ht->cmpnodes    = strcmp;
+	ht->addnode     = addhashnode;
+	ht->getnode     = gethashnode2;
+	ht->getnode2    = gethashnode2;
+	ht->removenode  = removehashnode;
+	ht->disablenode = NULL;
+	ht->enablenode  = NULL;
+	ht->freenode    = freescopenode;
+	ht->printnode   = NULL;
+    }
+    if (!ht->getnode2(ht, pm->node.nam))
+	ht->addnode(ht, ztrdup(pm->node.nam),
+		    zshcalloc(sizeof(struct hashnode)));
+}
+
+/*
+ * Restore a parameter noted for a level above locallevel.  One whose
+ * level has since been lowered (as for private parameters) is noted
+ * again for its new level.
+ */
+
+/**/
+static void
+scanscopeparam(HashNode hn, UNUSED(int flags))
+{
+    Param pm;
+
+    if ((pm = (Param) gethashnode2(realparamtab, hn->nam))) {
+	if (pm->level > locallevel)
+	    scanendscope(&pm->node, 0);
+	else
+	    scopeparam(pm);
+    }
+}
+
+/**/
+static void
+endscopeparams(void)
+{
+    int lev;
+
+    for (lev = scopeparamsz - 1; lev > locallevel; lev--) {
+	HashTable ht = scopeparams[lev];
+
+	if (!ht || !ht->ct)
+	    continue;
+	scanhashtable(ht, 0, 0, 0, scanscopeparam, 0);
+	if (ht->hsize > 4 * SCOPEPARAMS_SIZE) {
+	    deletehashtable(ht);
+	    scopeparams[lev] = NULL;
+	} else
+	    emptyhashtable(ht);
+    }
+}
+
+/**/
+#ifdef DEBUG
+
+/**/
+static void
+checkendscope(HashNode hn, UNUSED(int flags))
+{
+    DPUTS1(((Param) hn)->level > locallevel,
+	   "BUG: local parameter %s not noted for its scope", hn->nam);
+}
+
+/**/
+#endif
+
 #ifdef USE_LOCALE
 /*
  * Flag that one of the special LC_ functions or LANG changed on scope
@@ -5590,7 +6082,13 @@ endparamscope(void)
 #ifdef USE_LOCALE
     lc_update_needed = 0;
 #endif
-    scanhashtable(paramtab, 0, 0, 0, scanendscope, 0);
+    if (paramtab == realparamtab) {
+	endscopeparams();
+#ifdef DEBUG
+	scanhashtable(paramtab, 0, 0, 0, checkendscope, 0);
+#endif
+    } else
+	scanhashtable(paramtab, 0, 0, 0, scanendscope, 0);
 #ifdef USE_LOCALE
     if (lc_update_needed)
     {
@@ -1699,6 +1699,9 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags,
 	!(pf_flags & PREFORK_SINGLE) && !qt;
     /* Scalar and array value, see isarr above */
     char *val = NULL, **aval = NULL;
+    /* For ${#array}, the parameter's value and its length if known */
+    char **lenaval = NULL;
+    int lenval = 0;
     /*
      * vbuf and v are both used to retrieve parameter values; this
      * is a kludge, we pass down vbuf and it may or may not return v.
@@ -2651,8 +2654,14 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags,
 	    if (v->isarr == SCANPM_WANTINDEX) {
 		isarr = v->isarr = 0;
 		val = dupstring(v->pm->node.nam);
-	    } else
+	    } else {
 		aval = getarrvalue(v);
+		/* The parameter may already know the length for ${#...} */
+		if (getlen == 1 && v->start == 0 && v->end == -1) {
+		    lenaval = aval;
+		    lenval = arrvaluelen(v->pm, aval);
+		}
+	    }
 	} else {
 	    /* Value retrieved from parameter/subexpression is scalar */
 	    if (v->pm->node.flags & PM_ARRAY) {
@@ -3030,6 +3039,7 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags,
 		}
 		*idend = sav;
 		copied = 1;
+		lenaval = NULL;
 		if (isarr) {
 		    if (nojoin)
 			isarr = -1;
@@ -3550,7 +3560,7 @@ colonsubscript:
 	    int sl = sep ? MB_METASTRLEN(sep) : 1;
 
 	    if (getlen == 1)
-		for (ctr = aval; *ctr; ctr++, len++);
+		len = (aval == lenaval) ? lenval : arrlen(aval);
 	    else if (getlen == 2) {
 		if (*aval)
 		    for (len = -sl, ctr = aval;
@@ -1264,7 +1264,7 @@ adduserdir(char *s, char *t, int flags, int always)
     }
 
     /* add the name */
-    nd = (Nameddir) zshcalloc(sizeof *nd);
+    nd = (Nameddir) zslabcalloc(sizeof *nd, MEMTAG_HASHNODE);
     nd->node.flags = flags;
     eptr = t + strlen(t);
     while (eptr > t && eptr[-1] == '/')
@@ -532,6 +532,7 @@ typedef struct funcstack *Funcstack;
 typedef struct funcwrap  *FuncWrap;
 typedef struct hashnode  *HashNode;
 typedef struct hashtable *HashTable;
+typedef struct hashview  *HashView;
 typedef struct heap      *Heap;
 typedef struct heapstack *Heapstack;
 typedef struct histent   *Histent;
@@ -1194,6 +1195,7 @@ typedef int      (*CompareFunc)    _((const char *, const char *));
  * scanhashtable or scanmatchtable    */
 typedef void     (*ScanFunc)       _((HashNode, int));
 typedef void     (*ScanTabFunc)    _((HashTable, ScanFunc, int));
+typedef HashNode (*ViewNodeFunc)   _((HashTable, HashNode, HashView));
 
 typedef void (*PrintTableStats) _((HashTable));
 
@@ -1224,6 +1226,7 @@ struct hashtable {
     FreeNodeFunc freenode;	/* pointer to function to free a node         */
     ScanFunc printnode;		/* pointer to function to print a node        */
     ScanTabFunc scantab;	/* pointer to function to scan table          */
+    ViewNodeFunc viewnode;	/* node to pass to scan functions, or NULL    */
 };
 
 /* generic hash table node */
@@ -1868,6 +1871,26 @@ struct param {
     char *ename;		/* name of corresponding environment var */
     Param old;			/* old struct for use with local         */
     int level;			/* if (old != NULL), level of localness  */
+
+    /*
+     * For ordinary scalars and arrays, the length of the value in
+     * bytes or elements and the number of bytes or slots allocated,
+     * so that the length needn't be counted and appends needn't copy.
+     * Only valid if vsize is non-zero; the standard set functions
+     * clear it.
+     */
+    int vlen;
+    int vsize;
+};
+
+/*
+ * Storage for the node a viewnode method passes to scan functions.
+ * Each scan supplies its own, so the node is only valid until the
+ * scan function returns and must not be kept beyond that.
+ */
+struct hashview {
+    struct param pm;
+    HashTable ht;		/* table holding the element */
 };
 
 /* structure stored in struct param's u.data by tied arrays */
@@ -2245,6 +2268,9 @@ struct histent {
     short *words;		/* Position of words in history     */
 				/*   line:  as pairs of start, end  */
     int nwords;			/* Number of words in history line  */
+    int dupidx;			/* Place among duplicates, if HIST_DUP */
+    char *dir;			/* Directory the line was entered in */
+    int status;			/* Exit status, if HIST_STATUS      */
     zlong histnum;		/* A sequential history number      */
 };
 
@@ -2255,6 +2281,13 @@ struct histent {
 #define HIST_FOREIGN	0x00000010	/* Command came from another shell */
 #define HIST_TMPSTORE	0x00000020	/* Kill when user enters another cmd */
 #define HIST_NOWRITE	0x00000040	/* Keep internally but don't write */
+#define HIST_NOWORDS	0x00000080	/* words not found yet, see gethistwords */
+#define HIST_STATUS	0x00000100	/* status holds the exit status */
+
+/* Exit status filters for histindexfilter() */
+
+#define HISTSTAT_ANY	(-1)	/* any status, or none known */
+#define HISTSTAT_FAILED	(-2)	/* any non-zero status */
 
 #define GETHIST_UPWARD  (-1)
 #define GETHIST_DOWNWARD  1
@@ -2434,7 +2467,9 @@ enum {
     HASHEXECUTABLESONLY,
     HASHLISTALL,
     HISTALLOWCLOBBER,
+    HISTATOMICAPPEND,
     HISTBEEP,
+    HISTBGREWRITE,
     HISTEXPIREDUPSFIRST,
     HISTFCNTLLOCK,
     HISTFINDNODUPS,
@@ -2449,6 +2484,7 @@ enum {
     HISTSAVENODUPS,
     HISTSUBSTPATTERN,
     HISTVERIFY,
+    HISTWATCHFILE,
     HUP,
     IGNOREBRACES,
     IGNORECLOSEBRACES,
@@ -2922,6 +2958,19 @@ struct heap {
 #endif
 ;
 
+/*
+ * Categories of small permanent objects allocated with zslaballoc().
+ * The mem builtin shows how much memory each of them uses.
+ */
+
+enum {
+    MEMTAG_PARAM,		/* struct param                              */
+    MEMTAG_HASHNODE,		/* nodes of the other hash tables            */
+    MEMTAG_ASSOC,		/* elements of plain associative arrays      */
+    MEMTAG_LINKNODE,		/* linked lists and their nodes              */
+    MEMTAG_COUNT
+};
+
 # define NEWHEAPS(h)    do { Heap _switch_oldheaps = h = new_heaps(); do
 # define OLDHEAPS       while (0); old_heaps(_switch_oldheaps); } while (0);
 
@@ -3278,6 +3327,10 @@ enum zexit_t {
 #define BEFORETRAPHOOK (zshhooks + 1)
 #define AFTERTRAPHOOK  (zshhooks + 2)
 #define GETCOLORATTR   (zshhooks + 3)
+#define AFTERCOMMANDHOOK (zshhooks + 4)
+#define BEFOREFORKHOOK (zshhooks + 5)
+#define BEFOREEXECHOOK (zshhooks + 6)
+#define IDLEHOOK       (zshhooks + 7)
 
 #ifdef MULTIBYTE_SUPPORT
 /* Final argument to mb_niceformat() */